@@ -9,6 +9,8 @@
 #define MAX_GHOSTS 25
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
 
 typedef enum {
     REACHED_PORTAL = 1,
@@ -44,16 +46,25 @@ typedef struct {
     int charged;
 } ghost_t;
 
-typedef struct {
-    char content; // stuff like 'P' for pacman 'M' for monster and 'W' for wall
-    int has_dot; // whether there is a dot in this position or not
-    int has_portal; // whether there is a portal in this position or not
-    pthread_mutex_t lock;
-} board_pos_t;
+// Entity ids stored per cell in board_t.occupancy, so "who is at (x, y)" is one load
+#define NO_ENTITY 0
+#define GHOST_ID_BASE 128
+#define PACMAN_ID(index) (1 + (index))
+#define GHOST_ID(index) (GHOST_ID_BASE + (index))
+
+#define BOARD_WORD_BITS 64
 
 typedef struct {
     int width, height; //dimensions of the board
-    board_pos_t* board; //actual board, most likely a row-major matrix
+    int row_words; // 64 bit words per row of each bit plane
+    uint64_t* walls; // bit planes with one bit per cell, row-major, every row padded to whole words
+    uint64_t* dots;
+    uint64_t* portals;
+    uint64_t* occupied; // cells with a pacman or a ghost
+    int col_words; // 64 bit words per column of each transposed plane
+    uint64_t* walls_t; // walls and occupied transposed, column-major, so columns scan like rows
+    uint64_t* occupied_t;
+    unsigned char* occupancy; // entity id per cell, row-major, kept up to date by the moves
     int n_pacmans; //number of pacmans in the board
     pacman_t* pacmans; // array containing every pacman in the board to iterate through when processing
     int n_ghosts; //number of ghosts in the board
@@ -62,15 +73,111 @@ typedef struct {
     char pacman_file[256]; // file with pacman movements
     char ghosts_files[MAX_GHOSTS][256]; // files with monster movements
     int tempo; // Duracao de cada jogada???
+    uint64_t rng; // random stream for the 'R' moves, see board_random
     pthread_rwlock_t state_lock;
 } board_t;
 
+// Bit plane helpers, (x, y) must be inside the board
+
+static inline int plane_get(const uint64_t* plane, const board_t* board, int x, int y) {
+    return (plane[y * board->row_words + x / BOARD_WORD_BITS] >> (x % BOARD_WORD_BITS)) & 1;
+}
+
+static inline void plane_set(uint64_t* plane, const board_t* board, int x, int y) {
+    plane[y * board->row_words + x / BOARD_WORD_BITS] |= (uint64_t)1 << (x % BOARD_WORD_BITS);
+}
+
+static inline void plane_clear(uint64_t* plane, const board_t* board, int x, int y) {
+    plane[y * board->row_words + x / BOARD_WORD_BITS] &= ~((uint64_t)1 << (x % BOARD_WORD_BITS));
+}
+
+static inline void column_set(uint64_t* plane, const board_t* board, int x, int y) {
+    plane[x * board->col_words + y / BOARD_WORD_BITS] |= (uint64_t)1 << (y % BOARD_WORD_BITS);
+}
+
+static inline void column_clear(uint64_t* plane, const board_t* board, int x, int y) {
+    plane[x * board->col_words + y / BOARD_WORD_BITS] &= ~((uint64_t)1 << (y % BOARD_WORD_BITS));
+}
+
+static inline void set_wall(board_t* board, int x, int y) {
+    plane_set(board->walls, board, x, y);
+    column_set(board->walls_t, board, x, y);
+}
+
+static inline int is_wall(const board_t* board, int x, int y) {
+    return plane_get(board->walls, board, x, y);
+}
+
+static inline int has_dot(const board_t* board, int x, int y) {
+    return plane_get(board->dots, board, x, y);
+}
+
+static inline int has_portal(const board_t* board, int x, int y) {
+    return plane_get(board->portals, board, x, y);
+}
+
+static inline int entity_at(const board_t* board, int x, int y) {
+    return board->occupancy[y * board->width + x];
+}
+
+// Index of the pacman at (x, y), -1 if there is none
+static inline int pacman_at(const board_t* board, int x, int y) {
+    int id = entity_at(board, x, y);
+    return id != NO_ENTITY && id < GHOST_ID_BASE ? id - PACMAN_ID(0) : -1;
+}
+
+// Index of the ghost at (x, y), -1 if there is none
+static inline int ghost_at(const board_t* board, int x, int y) {
+    int id = entity_at(board, x, y);
+    return id >= GHOST_ID_BASE ? id - GHOST_ID_BASE : -1;
+}
+
+static inline void set_entity(board_t* board, int x, int y, int id) {
+    board->occupancy[y * board->width + x] = id;
+    if (id == NO_ENTITY) {
+        plane_clear(board->occupied, board, x, y);
+        column_clear(board->occupied_t, board, x, y);
+    }
+    else {
+        plane_set(board->occupied, board, x, y);
+        column_set(board->occupied_t, board, x, y);
+    }
+}
+
+// Random numbers for the board's moves, xorshift64*. Every board has its own
+// stream, so sessions neither share rand()'s lock nor each other's sequence.
+static inline uint32_t board_random(board_t* board) {
+    uint64_t x = board->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    board->rng = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/*Starts the board's random stream, each (seed, stream) pair gives an independent sequence*/
+void seed_board(board_t* board, uint64_t seed, uint64_t stream);
+
+/*Hash of everything a move can change, two boards that played the same way hash the same*/
+uint64_t board_hash(const board_t* board);
+
+/*Allocates the empty bit planes, transposed planes and occupancy layer for width x height in a single block*/
+int alloc_board_cells(board_t* board);
+
+/*Points the planes of a width x height board into block, laid out like alloc_board_cells does*/
+void attach_board_cells(board_t* board, uint64_t* block);
+
+/*Bytes of the block holding the planes and the occupancy layer, only needs width and height*/
+size_t board_cells_size(const board_t* board);
+
 /*Move pacman/monster in a certain direction on the board must check for boundaries, walls and other monsters
 Maybe do 1 function for pacman and 1 for monsters if required
 Maybe do 1 function for each direction
 */
 int move_pacman(board_t* board, int pacman_index, command_t* command);
 int move_ghost(board_t* board, int ghost_index, command_t* command);
+/*Charged move of a ghost: slides in direction until the next wall or entity*/
+int move_ghost_charged(board_t* board, int ghost_index, char direction);
 
 /*Remove an object (Pacman)*/
 void kill_pacman(board_t* board, int pacman_index);
@@ -86,7 +193,9 @@ int load_ghost(board_t* board);
 Fils the board with the information coming from the file
 */
 int load_level(board_t* board, char* filename, char* dirname, int accumulated_points);
-// Unloads levels loaded by load_level
+/*Copies a level loaded by load_level into board, which can then be played on its own*/
+int clone_level(board_t* board, const board_t* level, int accumulated_points);
+// Unloads levels loaded by load_level or clone_level
 void unload_level(board_t * board);
 
 // DEBUG FILE
@@ -101,4 +210,14 @@ void print_board(board_t* board);
 
 void sleep_ms(int milliseconds);
 
+/*Current CLOCK_MONOTONIC time in nanoseconds*/
+uint64_t monotonic_ns();
+
+/*Sleeps until the absolute CLOCK_MONOTONIC time deadline_ns*/
+void sleep_until(uint64_t deadline_ns);
+
+/*Moves *deadline_ns one period of period_ms forward, past the current time if the caller
+fell behind. Returns how many deadlines had already gone by and were skipped*/
+int next_deadline(uint64_t *deadline_ns, int period_ms);
+
 #endif
@@ -0,0 +1,43 @@
+#ifndef CMD_RING_H
+#define CMD_RING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define CMD_RING_SIZE 64 // power of two
+
+// Which of the pending commands a turn plays
+typedef enum {
+    INPUT_LATEST = 0, // the newest, older ones are discarded
+    INPUT_QUEUE_ALL = 1, // the oldest, one per turn, so a burst plays out in order
+    INPUT_ONE_AHEAD = 2, // the oldest, and of the rest only the newest is kept for the next turn
+} input_mode_t;
+
+typedef struct {
+    char command;
+    uint64_t received_ns; // CLOCK_MONOTONIC when the request was read
+} timed_command_t;
+
+/*
+Lock free single producer single consumer queue of the commands a client sent:
+the I/O thread pushes, the thread playing the session pops.
+A zeroed cmd_ring_t is an empty queue.
+*/
+typedef struct {
+    timed_command_t slots[CMD_RING_SIZE];
+    _Alignas(64) _Atomic uint32_t head; // written by the producer
+    _Alignas(64) _Atomic uint32_t tail; // written by the consumer
+    unsigned long dropped; // commands pushed while full, producer only
+    unsigned long skipped; // commands the mode discarded, consumer only
+} cmd_ring_t;
+
+/*Queues a command. Returns -1 if the queue is full and it was dropped*/
+int cmd_ring_push(cmd_ring_t* ring, char command, uint64_t received_ns);
+
+/*Takes the command to play this turn according to mode. Returns 0 if there is none*/
+int cmd_ring_pop(cmd_ring_t* ring, input_mode_t mode, timed_command_t* out);
+
+/*Parses "latest", "all" or "ahead", returns -1 for anything else*/
+int parse_input_mode(const char* name);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "board.h"
+#include "outqueue.h"
+
+/*
+Builds the frames sent on a notification pipe.
+A keyframe (OP_CODE_BOARD) carries the whole grid, a delta (OP_CODE_BOARD_DELTA)
+only the cells that changed since the previous frame. Keyframes are sent for
+the first frame, when the dimensions change, every keyframe_interval frames,
+after encoder_force_keyframe and whenever a delta would not be smaller.
+*/
+typedef struct {
+    int width, height; // dimensions of the grid the client has
+    char *prev; // grid the client has after the last frame
+    char *next; // grid being built for the next frame
+    int seq;
+    int since_keyframe;
+    int keyframe_interval; // 1 sends only keyframes
+    int force_keyframe;
+} frame_encoder_t;
+
+void encoder_init(frame_encoder_t* enc, int keyframe_interval);
+
+void encoder_destroy(frame_encoder_t* enc);
+
+/*Returns the buffer where the next width x height grid must be rendered*/
+char* encoder_grid(frame_encoder_t* enc, int width, int height);
+
+/*Encodes the grid rendered in encoder_grid. Returns NULL if out of memory*/
+frame_t* encoder_encode(frame_encoder_t* enc, int tempo, int points);
+
+/*Keyframe of the last frame encoder_encode returned, same seq, for a client that
+joins the stream late or lost a frame: the deltas that follow apply on top of it*/
+frame_t* encoder_keyframe(frame_encoder_t* enc, int tempo, int points);
+
+/*Makes the next frame a keyframe, e.g. after the client missed a frame*/
+void encoder_force_keyframe(frame_encoder_t* enc);
+
+/*Glyph the client draws for a cell: # wall, @ portal, . dot, C pacman, M ghost*/
+static inline char cell_glyph(const board_t* board, int x, int y) {
+    int id = entity_at(board, x, y);
+    if (id >= GHOST_ID_BASE) return 'M';
+    if (id != NO_ENTITY) return 'C';
+    if (is_wall(board, x, y)) return '#';
+    if (has_portal(board, x, y)) return '@';
+    if (has_dot(board, x, y)) return '.';
+    return ' ';
+}
+
+/*Fills grid with the glyph of every cell, row-major*/
+void render_board(board_t* board, char* grid);
+
+#endif
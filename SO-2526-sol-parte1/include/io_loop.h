@@ -0,0 +1,22 @@
+#ifndef IO_LOOP_H
+#define IO_LOOP_H
+
+/*
+Single I/O thread that multiplexes every client request pipe and the
+register FIFO with edge triggered epoll.
+Handlers run on the I/O thread and must read their fd until EAGAIN.
+*/
+typedef void (*io_handler_t)(int fd, void *arg);
+
+int io_loop_init();
+
+/*Watches a non blocking fd for input. Must not be called from a handler*/
+int io_loop_add(int fd, io_handler_t handler, void *arg);
+
+/*Stops watching fd. Once it returns the handler is not running and will not run again for it*/
+void io_loop_remove(int fd);
+
+/*Runs handlers for ready fds forever*/
+void io_loop_run();
+
+#endif
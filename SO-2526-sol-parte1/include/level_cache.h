@@ -0,0 +1,36 @@
+#ifndef LEVEL_CACHE_H
+#define LEVEL_CACHE_H
+
+#include "board.h"
+
+/*
+Every level of the levels directory, parsed once at startup and kept as an
+immutable template that sessions copy from.
+Levels keep the index they got at startup, in readdir order, new ones are appended.
+*/
+
+/*
+Parses every .lvl in dirname, or maps it if it is a bundle compiled by levelc.
+Returns the number of levels or -1 if dirname can't be read.
+*/
+int level_cache_init(char *dirname);
+
+/*Writes every cached level into a bundle at path. Returns the number of levels written or -1*/
+int level_cache_write_bundle(char *path);
+
+/*Number of level indexes, including removed levels*/
+int level_cache_count();
+
+/*Cells of the largest level cached so far, reloads included*/
+size_t level_cache_max_cells();
+
+/*Copies level index into board. Returns -1 if the level was removed or the copy failed*/
+int level_cache_load(int index, board_t *board, int accumulated_points);
+
+/*inotify fd that reports changes to the levels directory, -1 if unavailable or loaded from a bundle*/
+int level_cache_watch_fd();
+
+/*I/O thread handler for level_cache_watch_fd, hands the files that changed to a reload thread that re-parses their levels*/
+void level_cache_changed(int fd, void *arg);
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <stddef.h>
+
+typedef enum {
+    DROP_OLDEST = 0, // a full queue discards its oldest unsent frame
+    DROP_NEWEST = 1, // a full queue discards the frame being pushed
+} drop_policy_t;
+
+// A frame can sit in several queues at once, e.g. a player's and its spectators'
+typedef struct {
+    int refs; // queues holding it, all of them used by the same thread
+    size_t size;
+    char data[];
+} frame_t;
+
+/*
+Bounded queue of frames waiting to be written to a non blocking fd.
+Only the thread producing the frames uses it, so it has no lock.
+A frame that was partially written is never dropped, so the stream the
+client reads is always made of whole frames.
+*/
+typedef struct {
+    int fd;
+    frame_t **frames;
+    int head;
+    int count;
+    int capacity;
+    size_t sent; // bytes of the front frame already written
+    drop_policy_t policy;
+    unsigned long dropped; // frames discarded because the client was too slow
+} outqueue_t;
+
+frame_t* frame_alloc(size_t size);
+
+/*Takes one more reference to queue the frame somewhere else as well*/
+frame_t* frame_ref(frame_t* frame);
+
+/*Drops a reference, the last one frees the frame*/
+void frame_release(frame_t* frame);
+
+/*fd must already be in non blocking mode*/
+int outqueue_init(outqueue_t* q, int fd, int capacity, drop_policy_t policy);
+
+void outqueue_destroy(outqueue_t* q);
+
+/*Queues a frame, taking over one reference to it, and writes as much as the fd takes.
+Returns -1 if the client is gone*/
+int outqueue_push(outqueue_t* q, frame_t* frame);
+
+/*Writes queued frames until the fd would block. Returns -1 if the client is gone*/
+int outqueue_flush(outqueue_t* q);
+
+/*Grows the pipe buffer of the fd to at least bytes, or as close as the system
+allows. Returns the buffer size, -1 if the fd is not a pipe*/
+int outqueue_reserve(outqueue_t* q, size_t bytes);
+
+/*Waits up to timeout_ms for every queued frame to be written. Returns 0 if it emptied*/
+int outqueue_drain(outqueue_t* q, int timeout_ms);
+
+/*Parses "oldest" or "newest", returns -1 for anything else*/
+int parse_drop_policy(const char* name);
+
+#endif
@@ -2,9 +2,20 @@
 #define PARSER_H
 
 #include "board.h"
-#define MAX_COMMAND_LENGTH 256
+#include <stddef.h>
+
+// A whole file read with a single read, split into lines in place
+typedef struct {
+    char* data;
+    size_t size;
+    size_t pos; // start of the next line
+} line_reader_t;
+
+int open_lines(line_reader_t* reader, const char* path);
+void close_lines(line_reader_t* reader);
+/*Next line without its terminator, NULL at the end of the file. Lines have no length limit*/
+char* read_line(line_reader_t* reader, size_t* len);
 
-int read_line(int fd, char* buffer);
 int read_level(board_t* board, char* filename, char* dirname);
 int read_pacman(board_t* board, int points);
 int read_ghosts(board_t* board);
@@ -1,13 +1,23 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
 #define MAX_PIPE_PATH_LENGTH 40
+#define MAX_SHM_NAME_LENGTH 40
 
 enum {
   OP_CODE_CONNECT = 1,
   OP_CODE_DISCONNECT = 2,
   OP_CODE_PLAY = 3,
   OP_CODE_BOARD = 4,
+  OP_CODE_BOARD_DELTA = 5,
+  OP_CODE_CONNECT_SHM = 6, // msg_connect_t asking for frames through shared memory
+  OP_CODE_SHM_ATTACH = 7,
+  OP_CODE_SHM_WAKE = 8,
+  OP_CODE_SPECTATE = 9, // msg_spectate_t, on the register FIFO
 };
 
 typedef struct {
@@ -16,6 +26,17 @@ typedef struct {
     char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
 } msg_connect_t;
 
+// Watch game game_id, or the oldest running game if it is 0, on notif_pipe_path.
+// The pipe must already be open for reading when the request is sent: the server
+// opens it without blocking, and closes it right away if there is no such game.
+// Frames are the player's ones, starting with a keyframe. A spectator leaves by
+// closing the pipe.
+typedef struct {
+    int op_code;
+    char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+    int game_id;
+} msg_spectate_t;
+
 typedef struct {
     int op_code;
 } msg_disconnect_t;
@@ -33,6 +54,71 @@ typedef struct {
     int victory;
     int game_over;
     int accumulated_points;
+    int seq; // frame sequence number, shared with msg_board_delta_t
 } msg_board_header_t;
 
+// Cells that changed since the frame numbered seq - 1, the board keeps the
+// dimensions of the last msg_board_header_t. Followed by n_cells msg_board_cell_t.
+typedef struct {
+    int op_code;
+    int seq;
+    int tempo;
+    int victory;
+    int game_over;
+    int accumulated_points;
+    int n_cells;
+} msg_board_delta_t;
+
+typedef struct {
+    int index; // y * width + x
+    char glyph;
+} msg_board_cell_t;
+
+// Frames now go through the shm_ring_t named name, the previous ring (if any)
+// has been fully consumed
+typedef struct {
+    int op_code;
+    char name[MAX_SHM_NAME_LENGTH];
+} msg_shm_attach_t;
+
+// New frames in the ring, sent only when the client said it was waiting
+typedef struct {
+    int op_code;
+} msg_shm_wake_t;
+
+/*
+Shared memory transport, for clients that connect with OP_CODE_CONNECT_SHM.
+The server publishes every frame, encoded exactly as it would be on the
+notification pipe, into the next slot of a single producer single consumer
+ring and only writes msg_shm_wake_t to the pipe when the client set waiting
+before blocking on it. Keyframes, deltas and cells are read from the slots;
+the pipe still carries msg_shm_attach_t, wakes and the game over header.
+A full ring drops frames like a full pipe queue does.
+*/
+typedef struct {
+    uint32_t n_slots;
+    uint32_t slot_size; // largest frame a slot holds
+    _Alignas(64) _Atomic uint64_t head; // frames published, written by the server
+    _Alignas(64) _Atomic uint64_t tail; // frames consumed, written by the client
+    _Alignas(64) _Atomic int waiting; // the client is about to block on the pipe
+} shm_ring_t;
+
+typedef struct {
+    uint32_t size;
+    char data[];
+} shm_slot_t;
+
+static inline size_t shm_slot_stride(uint32_t slot_size) {
+    return (sizeof(shm_slot_t) + slot_size + 63) & ~(size_t)63;
+}
+
+static inline size_t shm_ring_size(uint32_t n_slots, uint32_t slot_size) {
+    return sizeof(shm_ring_t) + n_slots * shm_slot_stride(slot_size);
+}
+
+// Slot of the frame numbered n
+static inline shm_slot_t* shm_ring_slot(shm_ring_t* ring, uint64_t n) {
+    return (shm_slot_t*)((char*)ring + sizeof(shm_ring_t) + (n % ring->n_slots) * shm_slot_stride(ring->slot_size));
+}
+
 #endif
\ No newline at end of file
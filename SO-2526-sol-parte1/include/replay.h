@@ -0,0 +1,43 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Append-only binary log of everything a tick engine session can't recompute:
+its seed, the client commands the pacman consumed, and a board hash at the end
+of every level so a replay can check it took the same path.
+A log is a replay_header_t followed by replay_record_t entries.
+*/
+
+#define REPLAY_MAGIC "PACLOG1"
+
+// Record kinds
+#define REPLAY_INPUT 'I' // the pacman consumed command on this tick
+#define REPLAY_LEVEL_END 'E' // the level ended on this tick with result (command) and board hash (value)
+
+typedef struct {
+    char magic[8];
+    uint64_t seed;
+    char levels[256]; // levels dir or bundle the session played, for reference
+} replay_header_t;
+
+typedef struct {
+    uint32_t tick; // tick of the level, starting at 1
+    uint16_t level; // level cache index
+    char kind;
+    char command;
+    uint64_t value;
+} replay_record_t;
+
+/*Creates dir/session-<id>.log with its header. Returns the fd or -1*/
+int replay_create(char *dir, int id, uint64_t seed, char *levels);
+
+/*Appends one record*/
+int replay_append(int fd, char kind, int level, unsigned long tick, char command, uint64_t value);
+
+/*Reads a whole log. records is malloc'ed, n_records excludes a torn last record*/
+int replay_load(char *path, replay_header_t *header, replay_record_t **records, size_t *n_records);
+
+#endif
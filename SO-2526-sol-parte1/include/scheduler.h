@@ -0,0 +1,20 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/*
+Task run by the worker pool.
+Returns the delay in milliseconds until it must run again, or -1 when it is done.
+A task is never run by two workers at the same time.
+*/
+typedef int (*task_fn_t)(void *arg);
+
+/*Starts n_workers worker threads and the timer wheel thread*/
+int scheduler_start(int n_workers);
+
+/*Schedules fn(arg) to run on the pool after delay_ms milliseconds*/
+void scheduler_submit(task_fn_t fn, void *arg, int delay_ms);
+
+/*Number of online cores, used as the default pool size*/
+int scheduler_default_workers();
+
+#endif
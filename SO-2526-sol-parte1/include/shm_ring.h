@@ -0,0 +1,24 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include "protocol.h"
+
+/*
+Server side of the shared memory transport described in protocol.h.
+Only the thread producing a session's frames uses its ring.
+*/
+
+/*Creates and maps a ring named name (see shm_open). Returns NULL on failure*/
+shm_ring_t* shm_ring_create(const char* name, int n_slots, size_t slot_size);
+
+/*Unmaps the ring and removes its name if the client did not already*/
+void shm_ring_destroy(shm_ring_t* ring, const char* name);
+
+/*Returns 1 when the client has read every published frame*/
+int shm_ring_empty(shm_ring_t* ring);
+
+/*Copies a frame into the next slot. Returns -1 if the ring is full, 1 if the
+client is waiting and must be sent a wake and 0 otherwise*/
+int shm_ring_publish(shm_ring_t* ring, const char* data, size_t size);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "board.h"
+#include <stdatomic.h>
+
+/*
+Rendered copy of a board that readers take without the board's state_lock.
+The game renders the whole board into it when a level is loaded and, after
+every move, the cells the move touched. Writers are already serialized by the
+game (state_lock or the tick engine), readers copy it under a seqlock and retry
+if a writer got in meanwhile, so encoding frames never holds up a mover.
+The grid is allocated once, as large as the largest level, and never moves,
+so a reader that can't wait, like the SIGUSR1 dump, can read it at any time.
+*/
+typedef struct {
+    atomic_uint seq; // odd while a writer is updating the snapshot
+    int width, height;
+    int tempo;
+    int points;
+    char level_name[MAX_FILENAME];
+    char *grid; // width x height glyphs, row-major, see cell_glyph
+    size_t capacity; // cells the grid holds, set by snapshot_init
+    // set by the thread sending frames, outside the seqlock
+    atomic_ulong dropped; // frames the player's queue dropped
+    atomic_int spectators;
+} board_snapshot_t;
+
+/*Allocates the grid for boards of up to max_cells cells. Returns -1 if out of memory.
+A zeroed board_snapshot_t is an empty snapshot without a grid*/
+int snapshot_init(board_snapshot_t* snap, size_t max_cells);
+
+void snapshot_destroy(board_snapshot_t* snap);
+
+/*Renders the whole board into the snapshot.
+Returns -1 if the board has more cells than the grid holds*/
+int snapshot_publish(board_snapshot_t* snap, board_t* board);
+
+/*Renders again the n cells at xy (x0, y0, x1, y1, ...) and the points after a move.
+Cells outside the board are skipped*/
+void snapshot_update(board_snapshot_t* snap, board_t* board, const int* xy, int n);
+
+/*Copies the glyphs into grid, which holds width x height cells, and returns the points*/
+int snapshot_read(board_snapshot_t* snap, char* grid);
+
+/*Reader side of the seqlock for readers that can't wait, like a signal handler
+that may have interrupted the writer: snapshot_begin never blocks and
+snapshot_retry tells whether what was read since is torn*/
+unsigned snapshot_begin(board_snapshot_t* snap);
+int snapshot_retry(board_snapshot_t* snap, unsigned seq);
+
+#endif
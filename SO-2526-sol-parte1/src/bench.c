@@ -0,0 +1,282 @@
+#include "board.h"
+#include "parser.h"
+#include "frame.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+Micro-benchmarks of the game core over a matrix of board sizes and ghost counts.
+Prints one key=value line per result so runs of two commits can be diffed.
+Usage: bench [-t ms] [name...]
+*/
+
+static const int SIZES[] = {10, 100, 500, 1000, 2000};
+static const int GHOSTS[] = {1, 8, 24};
+#define N_SIZES (int)(sizeof(SIZES) / sizeof(SIZES[0]))
+#define N_GHOST_COUNTS (int)(sizeof(GHOSTS) / sizeof(GHOSTS[0]))
+
+static int budget_ms = 100; // -t: time spent on every result
+static uint64_t layout_rng; // xorshift64 state used to lay out the boards
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t layout_random() {
+    layout_rng ^= layout_rng << 13;
+    layout_rng ^= layout_rng >> 7;
+    layout_rng ^= layout_rng << 17;
+    return (uint32_t) layout_rng;
+}
+
+// Border walls, 10% scattered walls and dots everywhere else, same layout on every run
+static int is_layout_wall(int width, int height, int x, int y) {
+    if (x == 0 || y == 0 || x == width - 1 || y == height - 1) return 1;
+    return layout_random() % 10 == 0;
+}
+
+static void free_cell(board_t *board, int *x, int *y) {
+    do {
+        *x = 1 + layout_random() % (board->width - 2);
+        *y = 1 + layout_random() % (board->height - 2);
+    } while (is_wall(board, *x, *y) || entity_at(board, *x, *y) != NO_ENTITY);
+}
+
+// Builds a playable board in memory, like load_level but without files
+static int build_board(board_t *board, int size, int n_ghosts) {
+    memset(board, 0, sizeof(*board));
+    board->width = size;
+    board->height = size;
+    board->tempo = 10;
+    board->n_pacmans = 1;
+    board->n_ghosts = n_ghosts;
+    if (alloc_board_cells(board) == -1) return -1;
+    board->pacmans = calloc(1, sizeof(pacman_t));
+    board->ghosts = calloc(n_ghosts, sizeof(ghost_t));
+    if (!board->pacmans || !board->ghosts) return -1;
+
+    layout_rng = 0x9E3779B97F4A7C15ULL;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            if (is_layout_wall(size, size, x, y)) set_wall(board, x, y);
+            else plane_set(board->dots, board, x, y);
+        }
+    }
+
+    pacman_t *pacman = &board->pacmans[0];
+    pacman->alive = 1;
+    free_cell(board, &pacman->pos_x, &pacman->pos_y);
+    set_entity(board, pacman->pos_x, pacman->pos_y, PACMAN_ID(0));
+
+    for (int i = 0; i < n_ghosts; i++) {
+        ghost_t *ghost = &board->ghosts[i];
+        free_cell(board, &ghost->pos_x, &ghost->pos_y);
+        set_entity(board, ghost->pos_x, ghost->pos_y, GHOST_ID(i));
+        ghost->moves[0].command = 'R';
+        ghost->moves[0].turns = 1;
+        ghost->n_moves = 1;
+    }
+
+    seed_board(board, 1, 0);
+    pthread_rwlock_init(&board->state_lock, NULL);
+    return 0;
+}
+
+// Puts a pacman that a ghost caught back on the board, so moves keep doing work
+static void revive_pacman(board_t *board) {
+    pacman_t *pacman = &board->pacmans[0];
+    if (pacman->alive) return;
+    free_cell(board, &pacman->pos_x, &pacman->pos_y);
+    set_entity(board, pacman->pos_x, pacman->pos_y, PACMAN_ID(0));
+    pacman->alive = 1;
+}
+
+static void report(const char *name, int size, int n_ghosts, unsigned long ops, uint64_t elapsed_ns) {
+    printf("bench=%s width=%d height=%d ghosts=%d ops=%lu ns_per_op=%.1f ops_per_s=%.0f\n",
+        name, size, size, n_ghosts, ops, (double) elapsed_ns / ops, ops * 1e9 / elapsed_ns);
+    fflush(stdout);
+}
+
+// One operation of a benchmark, i counts the operations done so far
+typedef void (*bench_op_t)(board_t *board, void *ctx, unsigned long i);
+
+// Runs op in batches until the time budget is spent and reports the average
+static void run(const char *name, board_t *board, void *ctx, bench_op_t op, int size, int n_ghosts) {
+    unsigned long ops = 0;
+    unsigned long batch = 1;
+    uint64_t budget = (uint64_t) budget_ms * 1000000;
+    uint64_t start = now_ns(), elapsed = 0;
+    while (elapsed < budget) {
+        for (unsigned long i = 0; i < batch; i++) op(board, ctx, ops + i);
+        ops += batch;
+        elapsed = now_ns() - start;
+        if (elapsed < budget / 16) batch *= 2; // keep the clock reads out of the measurement
+    }
+    report(name, size, n_ghosts, ops, elapsed);
+}
+
+static void op_move_pacman(board_t *board, void *ctx, unsigned long i) {
+    (void) ctx;
+    static command_t commands[] = {{'D', 1, 1}, {'S', 1, 1}, {'A', 1, 1}, {'W', 1, 1}, {'R', 1, 1}};
+    revive_pacman(board);
+    move_pacman(board, 0, &commands[i % 5]);
+}
+
+static void op_move_ghost(board_t *board, void *ctx, unsigned long i) {
+    (void) ctx;
+    int g = i % board->n_ghosts;
+    revive_pacman(board);
+    move_ghost(board, g, &board->ghosts[g].moves[0]);
+}
+
+static void op_move_ghost_charged(board_t *board, void *ctx, unsigned long i) {
+    (void) ctx;
+    static const char directions[] = {'D', 'S', 'A', 'W'};
+    int g = i % board->n_ghosts;
+    revive_pacman(board);
+    move_ghost_charged(board, g, directions[(i / board->n_ghosts) % 4]);
+}
+
+// What send_board does for a frame: render the board and encode it against the last one.
+// One ghost moves per frame so deltas carry changes.
+static void op_frame(board_t *board, void *ctx, unsigned long i) {
+    frame_encoder_t *enc = ctx;
+    int g = i % board->n_ghosts;
+    revive_pacman(board);
+    move_ghost(board, g, &board->ghosts[g].moves[0]);
+
+    render_board(board, encoder_grid(enc, board->width, board->height));
+    frame_release(encoder_encode(enc, board->tempo, board->pacmans[0].points));
+}
+
+// Writes the board built for size and n_ghosts as a level directory
+static int write_level(char *dir, board_t *board) {
+    char path[MAX_FILENAME];
+    snprintf(path, sizeof(path), "%s/bench.lvl", dir);
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    fprintf(f, "DIM %d %d\nTEMPO %d\nMON", board->height, board->width, board->tempo);
+    for (int i = 0; i < board->n_ghosts; i++) fprintf(f, " g%d.m", i);
+    fprintf(f, "\n");
+
+    char *row = malloc(board->width + 1);
+    for (int y = 0; y < board->height; y++) {
+        for (int x = 0; x < board->width; x++) row[x] = is_wall(board, x, y) ? 'X' : 'o';
+        row[board->width] = '\n';
+        fwrite(row, 1, board->width + 1, f);
+    }
+    free(row);
+    fclose(f);
+
+    for (int i = 0; i < board->n_ghosts; i++) {
+        snprintf(path, sizeof(path), "%s/g%d.m", dir, i);
+        f = fopen(path, "w");
+        if (!f) return -1;
+        fprintf(f, "PASSO 0\nPOS %d %d\nR\nC\nD\nT 2\n", board->ghosts[i].pos_y, board->ghosts[i].pos_x);
+        fclose(f);
+    }
+    return 0;
+}
+
+static void remove_level(char *dir, int n_ghosts) {
+    char path[MAX_FILENAME];
+    snprintf(path, sizeof(path), "%s/bench.lvl", dir);
+    unlink(path);
+    for (int i = 0; i < n_ghosts; i++) {
+        snprintf(path, sizeof(path), "%s/g%d.m", dir, i);
+        unlink(path);
+    }
+}
+
+static void op_read_level(board_t *board, void *ctx, unsigned long i) {
+    (void) board;
+    (void) i;
+    board_t level = {0};
+    if (load_level(&level, "bench.lvl", ctx, 0) == 0) unload_level(&level);
+}
+
+static int selected(int argc, char **argv, const char *name) {
+    if (argc == 0) return 1;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+            case 't':
+                budget_ms = atoi(optarg);
+                break;
+            default:
+                printf("Usage: %s [-t ms] [move_pacman|move_ghost|move_ghost_charged|frame|read_level...]\n", argv[0]);
+                return -1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    open_debug_file("/dev/null"); // the game logs every kill and every parsed row
+
+    char dir[] = "/tmp/pacman-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    for (int s = 0; s < N_SIZES; s++) {
+        for (int g = 0; g < N_GHOST_COUNTS; g++) {
+            int size = SIZES[s], n_ghosts = GHOSTS[g];
+            board_t board;
+
+            if (selected(argc, argv, "move_pacman")) {
+                if (build_board(&board, size, n_ghosts) == -1) goto oom;
+                run("move_pacman", &board, NULL, op_move_pacman, size, n_ghosts);
+                unload_level(&board);
+            }
+            if (selected(argc, argv, "move_ghost")) {
+                if (build_board(&board, size, n_ghosts) == -1) goto oom;
+                run("move_ghost", &board, NULL, op_move_ghost, size, n_ghosts);
+                unload_level(&board);
+            }
+            if (selected(argc, argv, "move_ghost_charged")) {
+                if (build_board(&board, size, n_ghosts) == -1) goto oom;
+                run("move_ghost_charged", &board, NULL, op_move_ghost_charged, size, n_ghosts);
+                unload_level(&board);
+            }
+            if (selected(argc, argv, "frame")) {
+                if (build_board(&board, size, n_ghosts) == -1) goto oom;
+                frame_encoder_t enc;
+                encoder_init(&enc, 50);
+                run("frame", &board, &enc, op_frame, size, n_ghosts);
+                encoder_destroy(&enc);
+                unload_level(&board);
+            }
+            if (selected(argc, argv, "read_level")) {
+                if (build_board(&board, size, n_ghosts) == -1) goto oom;
+                if (write_level(dir, &board) == 0) {
+                    run("read_level", NULL, dir, op_read_level, size, n_ghosts);
+                }
+                remove_level(dir, n_ghosts);
+                unload_level(&board);
+            }
+        }
+    }
+
+    rmdir(dir);
+    return 0;
+
+oom:
+    perror("build board");
+    rmdir(dir);
+    return 1;
+}
@@ -2,23 +2,26 @@
 #include "parser.h"
 #include <stdlib.h>
 #include <stdio.h> //snprintf
+#include <string.h>
 #include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 #include <pthread.h>
 
 FILE * debugfile;
 
 // Helper private function to find and kill pacman at specific position
 static int find_and_kill_pacman(board_t* board, int new_x, int new_y) {
-    for (int p = 0; p < board->n_pacmans; p++) {
-        pacman_t* pac = &board->pacmans[p];
-        if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
-            pac->alive = 0;
-            kill_pacman(board, p);
-            return DEAD_PACMAN;
-        }
+    int p = pacman_at(board, new_x, new_y);
+    if (p < 0) return VALID_MOVE;
+
+    pacman_t* pac = &board->pacmans[p];
+    if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
+        pac->alive = 0;
+        kill_pacman(board, p);
+        return DEAD_PACMAN;
     }
     return VALID_MOVE;
 }
@@ -40,6 +43,35 @@ void sleep_ms(int milliseconds) {
     nanosleep(&ts, NULL);
 }
 
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t deadline_ns) {
+    struct timespec ts = { .tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int next_deadline(uint64_t *deadline_ns, int period_ms) {
+    uint64_t period = (uint64_t)period_ms * 1000000;
+    uint64_t now = monotonic_ns();
+    if (period == 0) {
+        *deadline_ns = now;
+        return 0;
+    }
+
+    *deadline_ns += period;
+    if (*deadline_ns > now) return 0;
+
+    // skip the periods that went by instead of running them back to back,
+    // so the step stays in phase with everything else started at the same time
+    uint64_t missed = (now - *deadline_ns) / period + 1;
+    *deadline_ns += missed * period;
+    return (int) missed;
+}
+
 int move_pacman(board_t* board, int pacman_index, command_t* command) {
     if (pacman_index < 0 || !board->pacmans[pacman_index].alive) {
         return DEAD_PACMAN; // Invalid or dead pacman
@@ -60,7 +92,7 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
 
     if (direction == 'R') {
         char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = directions[board_random(board) % 4];
     }
 
     // Calculate new position based on direction
@@ -96,81 +128,78 @@ int move_pacman(board_t* board, int pacman_index, command_t* command) {
         return INVALID_MOVE;
     }
 
-    int new_index = get_board_index(board, new_x, new_y);
-    int old_index = get_board_index(board, pac->pos_x, pac->pos_y);
-
-    // locks
-    if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
-    }
-
-    char target_content = board->board[new_index].content;
-
-    if (board->board[new_index].has_portal) {
-        board->board[old_index].content = ' ';
-        board->board[new_index].content = 'P';
+    // Moves run with the board's state_lock held for writing, so cells need no locks of their own
+    if (has_portal(board, new_x, new_y)) {
+        set_entity(board, pac->pos_x, pac->pos_y, NO_ENTITY);
+        set_entity(board, new_x, new_y, PACMAN_ID(pacman_index));
         return REACHED_PORTAL;
     }
 
     // Check for walls
-    if (target_content == 'W') {
-        goto move_pacman_invalid;
+    if (is_wall(board, new_x, new_y)) {
+        return INVALID_MOVE;
     }
 
     // Check for ghosts
-    if (target_content == 'M') {
+    if (ghost_at(board, new_x, new_y) >= 0) {
         kill_pacman(board, pacman_index);
-        goto move_pacman_dead;
+        return DEAD_PACMAN;
     }
 
     // Collect points
-    if (board->board[new_index].has_dot) {
+    if (has_dot(board, new_x, new_y)) {
         pac->points++;
-        board->board[new_index].has_dot = 0;
+        plane_clear(board->dots, board, new_x, new_y);
     }
 
-    board->board[old_index].content = ' ';
+    set_entity(board, pac->pos_x, pac->pos_y, NO_ENTITY);
     pac->pos_x = new_x;
     pac->pos_y = new_y;
-    board->board[new_index].content = 'P';
+    set_entity(board, new_x, new_y, PACMAN_ID(pacman_index));
 
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    
     return VALID_MOVE;
+}
 
-    move_pacman_invalid:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    return INVALID_MOVE;
+// Blocker scans over a row of a plane or a column of a transposed plane.
+// A blocker is a bit set in either line; whole words are skipped with one test
+// and the nearest bit in a word is found with count trailing/leading zeros.
+
+// First blocker in [from, end), or end if there is none
+static int scan_up(const uint64_t* a, const uint64_t* b, int from, int end) {
+    if (from >= end) return end;
+    int w = from / BOARD_WORD_BITS;
+    uint64_t word = (a[w] | b[w]) & (~(uint64_t)0 << (from % BOARD_WORD_BITS));
+    int last = (end - 1) / BOARD_WORD_BITS;
+    while (!word) {
+        if (++w > last) return end;
+        word = a[w] | b[w];
+    }
+    int bit = w * BOARD_WORD_BITS + __builtin_ctzll(word);
+    return bit < end ? bit : end;
+}
 
-    move_pacman_dead:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
+// Last blocker in [0, from], or -1 if there is none
+static int scan_down(const uint64_t* a, const uint64_t* b, int from) {
+    if (from < 0) return -1;
+    int w = from / BOARD_WORD_BITS;
+    int shift = BOARD_WORD_BITS - 1 - from % BOARD_WORD_BITS;
+    uint64_t word = (a[w] | b[w]) & (~(uint64_t)0 >> shift);
+    while (!word) {
+        if (--w < 0) return -1;
+        word = a[w] | b[w];
+    }
+    return w * BOARD_WORD_BITS + BOARD_WORD_BITS - 1 - __builtin_clzll(word);
+}
+
+// A charging ghost stops before a wall or a ghost and on top of pacman, killing him.
+// Returns 1 if the ghost stops on (x, y).
+static int charge_hit(board_t* board, int x, int y, int* result) {
+    if (!is_wall(board, x, y) && pacman_at(board, x, y) >= 0) {
+        *result = find_and_kill_pacman(board, x, y);
+        return 1;
     }
-    return DEAD_PACMAN;
+    *result = VALID_MOVE;
+    return 0;
 }
 
 int move_ghost_charged(board_t* board, int ghost_index, char direction) {
@@ -179,128 +208,58 @@ int move_ghost_charged(board_t* board, int ghost_index, char direction) {
     int y = ghost->pos_y;
     int new_x = x;
     int new_y = y;
-    int result;
+    int result = VALID_MOVE;
+    int hit;
 
     ghost->charged = 0; //uncharge
 
+    const uint64_t *walls_row = board->walls + y * board->row_words;
+    const uint64_t *occupied_row = board->occupied + y * board->row_words;
+    const uint64_t *walls_col = board->walls_t + x * board->col_words;
+    const uint64_t *occupied_col = board->occupied_t + x * board->col_words;
+
     switch (direction) {
         case 'W':
             if (y == 0) return INVALID_MOVE;
 
-            for (int i = 0; i <= y; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
-            }
-
-            new_y = 0; // In case there is no colision
-            for (int i = y - 1; i >= 0; i--) {
-                char target_content = board->board[i * board->width + x].content;
-                if (target_content == 'W' || target_content == 'M') {
-                    new_y = i + 1; // stop before colision
-                    result = VALID_MOVE;
-                    break;
-                }
-                else if (target_content == 'P') {
-                    new_y = i;
-                    result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
-                }
-            }
-
-            for (int i = 0; i <= y; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
-            }
+            hit = scan_down(walls_col, occupied_col, y - 1);
+            if (hit < 0) new_y = 0; // In case there is no colision
+            else new_y = charge_hit(board, x, hit, &result) ? hit : hit + 1; // stop before colision
             break;
         case 'S':
             if (y == board->height - 1) return INVALID_MOVE;
 
-            for (int i = y; i < board->height; i++) {
-                pthread_mutex_lock(&board->board[i * board->width + x].lock);
-            }
-
-            new_y = board->height - 1; // In case there is no colision
-            for (int i = y + 1; i < board->height; i++) {
-                char target_content = board->board[i * board->width + x].content;
-                if (target_content == 'W' || target_content == 'M') {
-                    new_y = i - 1; // stop before colision
-                    result = VALID_MOVE;
-                    break;
-                }
-                else if (target_content == 'P') {
-                    new_y = i;
-                    result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
-                }
-            }
-
-            for (int i = y; i < board->height; i++) {
-                pthread_mutex_unlock(&board->board[i * board->width + x].lock);
-            }
+            hit = scan_up(walls_col, occupied_col, y + 1, board->height);
+            if (hit == board->height) new_y = board->height - 1; // In case there is no colision
+            else new_y = charge_hit(board, x, hit, &result) ? hit : hit - 1; // stop before colision
             break;
         case 'A':
             if (x == 0) return INVALID_MOVE;
 
-            for (int j = 0; j <= x; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
-            }
-
-            new_x = 0; // In case there is no colision
-            for (int j = x - 1; j >= 0; j--) {
-                char target_content = board->board[y * board->width + j].content;
-                if (target_content == 'W' || target_content == 'M') {
-                    new_x = j + 1; // stop before colision
-                    result = VALID_MOVE;
-                    break;
-                }
-                else if (target_content == 'P') {
-                    new_x = j;
-                    result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
-                }
-            }
-
-            for (int j = 0; j <= x; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
-            }
+            hit = scan_down(walls_row, occupied_row, x - 1);
+            if (hit < 0) new_x = 0; // In case there is no colision
+            else new_x = charge_hit(board, hit, y, &result) ? hit : hit + 1; // stop before colision
             break;
         case 'D':
             if (x == board->width - 1) return INVALID_MOVE;
 
-            for (int j = x; j < board->width; j++) {
-                pthread_mutex_lock(&board->board[y * board->width + j].lock);
-            }
-
-            new_x = board->width - 1; // In case there is no colision
-            for (int j = x + 1; j < board->width; j++) {
-                char target_content = board->board[y * board->width + j].content;
-                if (target_content == 'W' || target_content == 'M') {
-                    new_x = j - 1; // stop before colision
-                    result = VALID_MOVE;
-                    break;
-                }
-                else if (target_content == 'P') {
-                    new_x = j;
-                    result = find_and_kill_pacman(board, new_x, new_y);
-                    break;
-                }
-            }
-
-            for (int j = x; j < board->width; j++) {
-                pthread_mutex_unlock(&board->board[y * board->width + j].lock);
-            }
+            hit = scan_up(walls_row, occupied_row, x + 1, board->width);
+            if (hit == board->width) new_x = board->width - 1; // In case there is no colision
+            else new_x = charge_hit(board, hit, y, &result) ? hit : hit - 1; // stop before colision
             break;
         default:
             debug("DEFAULT CHARGED MOVE - direction = %c\n", direction);
             return INVALID_MOVE;
     }
 
-    board->board[y * board->width + x].content = ' '; // Or restore the dot if ghost was on one
+    set_entity(board, x, y, NO_ENTITY);
 
     // Update ghost position
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
 
     // Update board - set new position
-    board->board[new_y * board->width + new_x].content = 'M';
+    set_entity(board, new_x, new_y, GHOST_ID(ghost_index));
     return result;
 }
 
@@ -320,7 +279,7 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
 
     if (direction == 'R') {
         char directions[] = {'W', 'S', 'A', 'D'};
-        direction = directions[rand() % 4];
+        direction = directions[board_random(board) % 4];
     }
 
     // Calculate new position based on direction
@@ -362,84 +321,31 @@ int move_ghost(board_t* board, int ghost_index, command_t* command) {
         return INVALID_MOVE;
     }
 
-    // Check board position
-    int new_index = new_y * board->width + new_x;
-    int old_index = ghost->pos_y * board->width + ghost->pos_x;
-
-    // locks
-    if (old_index < new_index) {
-        pthread_mutex_lock(&board->board[old_index].lock);
-        pthread_mutex_lock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_lock(&board->board[new_index].lock);
-        pthread_mutex_lock(&board->board[old_index].lock);
-    }
-
-    char target_content = board->board[new_index].content;
-
-    // Check for walls
-    if (target_content == 'W') {
-        goto move_ghost_invalid;
-    }
-
-    // Check for ghosts
-    if (target_content == 'M') {
-        goto move_ghost_invalid;
+    // Check for walls and ghosts
+    if (is_wall(board, new_x, new_y) || ghost_at(board, new_x, new_y) >= 0) {
+        return INVALID_MOVE;
     }
 
-    int result = VALID_MOVE;
     // Check for pacman
-    if (target_content == 'P') {
-        for (int i = 0; i < board->n_pacmans; i++) {
-            pacman_t* pac = &board->pacmans[i];
-            if (pac->pos_x == new_x && pac->pos_y == new_y && pac->alive) {
-                pac->alive = 0; // Pacman dies
-                kill_pacman(board, i);
-                result = DEAD_PACMAN;
-                break;
-            }
-        }
-    }
+    int result = find_and_kill_pacman(board, new_x, new_y);
 
-    // Update board - clear old position (restore what was there)
-    board->board[old_index].content = ' '; // Or restore the dot if ghost was on one
+    // Update board - clear old position
+    set_entity(board, ghost->pos_x, ghost->pos_y, NO_ENTITY);
     // Update ghost position
     ghost->pos_x = new_x;
     ghost->pos_y = new_y;
     // Update board - set new position
-    board->board[new_index].content = 'M';
+    set_entity(board, new_x, new_y, GHOST_ID(ghost_index));
 
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    
     return result;
-
-    move_ghost_invalid:
-    if (old_index < new_index) {
-        pthread_mutex_unlock(&board->board[old_index].lock);
-        pthread_mutex_unlock(&board->board[new_index].lock);
-    }
-    else {
-        pthread_mutex_unlock(&board->board[new_index].lock);
-        pthread_mutex_unlock(&board->board[old_index].lock);
-    }
-    return INVALID_MOVE;
 }
 
 void kill_pacman(board_t* board, int pacman_index) {
     debug("Killing %d pacman\n\n", pacman_index);
     pacman_t* pac = &board->pacmans[pacman_index];
-    int index = pac->pos_y * board->width + pac->pos_x;
 
     // Remove pacman from the board
-    board->board[index].content = ' ';
+    set_entity(board, pac->pos_x, pac->pos_y, NO_ENTITY);
 
     // Mark pacman as dead
     pac->alive = 0;
@@ -447,7 +353,7 @@ void kill_pacman(board_t* board, int pacman_index) {
 
 // Static Loading
 int load_pacman(board_t* board) {
-    board->board[1 * board->width + 1].content = 'P'; // Pacman
+    set_entity(board, 1, 1, PACMAN_ID(0)); // Pacman
     board->pacmans[0].pos_x = 1;
     board->pacmans[0].pos_y = 1;
     board->pacmans[0].alive = 1;
@@ -457,15 +363,44 @@ int load_pacman(board_t* board) {
 
 // Static Loading
 int load_ghost(board_t* board) {
-    board->board[4 * board->width + 8].content = 'M'; // Monster
+    set_entity(board, 8, 4, GHOST_ID(0)); // Monster
     board->ghosts[0].pos_x = 8;
     board->ghosts[0].pos_y = 4;
-    board->board[0 * board->width + 5].content = 'M'; // Monster
+    set_entity(board, 5, 0, GHOST_ID(1)); // Monster
     board->ghosts[1].pos_x = 5;
     board->ghosts[1].pos_y = 0;
     return 0;
 }
 
+size_t board_cells_size(const board_t* board) {
+    size_t plane_words = (size_t)((board->width + BOARD_WORD_BITS - 1) / BOARD_WORD_BITS) * board->height;
+    size_t column_words = (size_t)((board->height + BOARD_WORD_BITS - 1) / BOARD_WORD_BITS) * board->width;
+    return (4 * plane_words + 2 * column_words) * sizeof(uint64_t) + (size_t)board->width * board->height;
+}
+
+void attach_board_cells(board_t* board, uint64_t* block) {
+    board->row_words = (board->width + BOARD_WORD_BITS - 1) / BOARD_WORD_BITS;
+    board->col_words = (board->height + BOARD_WORD_BITS - 1) / BOARD_WORD_BITS;
+    size_t plane_words = (size_t)board->row_words * board->height;
+    size_t column_words = (size_t)board->col_words * board->width;
+
+    board->walls = block;
+    board->dots = block + plane_words;
+    board->portals = block + 2 * plane_words;
+    board->occupied = block + 3 * plane_words;
+    board->walls_t = block + 4 * plane_words;
+    board->occupied_t = block + 4 * plane_words + column_words;
+    board->occupancy = (unsigned char*)(block + 4 * plane_words + 2 * column_words);
+}
+
+int alloc_board_cells(board_t* board) {
+    uint64_t *block = calloc(1, board_cells_size(board));
+    if (!block) return -1;
+
+    attach_board_cells(board, block);
+    return 0;
+}
+
 int load_level(board_t *board, char *filename, char* dirname, int points) {
 
     if (read_level(board, filename, dirname) < 0) {
@@ -483,20 +418,97 @@ int load_level(board_t *board, char *filename, char* dirname, int points) {
 
     pthread_rwlock_init(&board->state_lock, NULL);
 
-    for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_init(&board->board[i].lock, NULL);
+    //print_board(board);
+    return 0;
+}
+
+// splitmix64 finalizer, spreads close seeds far apart
+static uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void seed_board(board_t *board, uint64_t seed, uint64_t stream) {
+    board->rng = mix64(seed ^ mix64(stream));
+    if (board->rng == 0) board->rng = 1; // xorshift never leaves zero
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001B3ULL;
     }
+    return hash;
+}
 
-    //print_board(board);
+static uint64_t hash_int(uint64_t hash, int value) {
+    return hash_bytes(hash, &value, sizeof(value));
+}
+
+// Countdowns of the 'T' moves, the rest of a move never changes while playing
+static uint64_t hash_moves(uint64_t hash, const command_t *moves, int n_moves) {
+    for (int i = 0; i < n_moves && i < MAX_MOVES; i++) hash = hash_int(hash, moves[i].turns_left);
+    return hash;
+}
+
+// Entities are hashed field by field, their structs have padding clone_level copies as is
+uint64_t board_hash(const board_t *board) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = hash_bytes(hash, board->walls, board_cells_size(board));
+    for (int i = 0; i < board->n_pacmans; i++) {
+        const pacman_t *pacman = &board->pacmans[i];
+        hash = hash_int(hash, pacman->pos_x);
+        hash = hash_int(hash, pacman->pos_y);
+        hash = hash_int(hash, pacman->alive);
+        hash = hash_int(hash, pacman->points);
+        hash = hash_int(hash, pacman->current_move);
+        hash = hash_int(hash, pacman->waiting);
+        hash = hash_moves(hash, pacman->moves, pacman->n_moves);
+    }
+    for (int i = 0; i < board->n_ghosts; i++) {
+        const ghost_t *ghost = &board->ghosts[i];
+        hash = hash_int(hash, ghost->pos_x);
+        hash = hash_int(hash, ghost->pos_y);
+        hash = hash_int(hash, ghost->current_move);
+        hash = hash_int(hash, ghost->waiting);
+        hash = hash_int(hash, ghost->charged);
+        hash = hash_moves(hash, ghost->moves, ghost->n_moves);
+    }
+    return hash_bytes(hash, &board->rng, sizeof(board->rng));
+}
+
+int clone_level(board_t *board, const board_t *level, int points) {
+    *board = *level;
+    board->pacmans = NULL;
+    board->ghosts = NULL;
+
+    // same dimensions, so alloc_board_cells lays the planes out exactly like the source
+    if (alloc_board_cells(board) == -1) return -1;
+    memcpy(board->walls, level->walls, board_cells_size(level));
+
+    board->pacmans = malloc(level->n_pacmans * sizeof(pacman_t));
+    board->ghosts = malloc(level->n_ghosts * sizeof(ghost_t));
+    if (!board->pacmans || (level->n_ghosts && !board->ghosts)) {
+        free(board->walls);
+        free(board->pacmans);
+        free(board->ghosts);
+        return -1;
+    }
+    memcpy(board->pacmans, level->pacmans, level->n_pacmans * sizeof(pacman_t));
+    memcpy(board->ghosts, level->ghosts, level->n_ghosts * sizeof(ghost_t));
+    board->pacmans[0].points = points;
+
+    pthread_rwlock_init(&board->state_lock, NULL);
     return 0;
 }
 
 void unload_level(board_t * board) {
     pthread_rwlock_destroy(&board->state_lock);
-    for (int i = 0; i < board->height * board->width; i++) {
-        pthread_mutex_destroy(&board->board[i].lock);
-    }
-    free(board->board);
+    free(board->walls); // the other planes and the occupancy layer share its block
     free(board->pacmans);
     free(board->ghosts);
 }
@@ -519,7 +531,7 @@ void debug(const char * format, ...) {
 }
 
 void print_board(board_t *board) {
-    if (!board || !board->board) {
+    if (!board || !board->walls) {
         debug("[%d] Board is empty or not initialized.\n", getpid());
         return;
     }
@@ -547,9 +559,12 @@ void print_board(board_t *board) {
 
     for (int y = 0; y < board->height; y++) {
         for (int x = 0; x < board->width; x++) {
-            int idx = y * board->width + x;
             if (offset < sizeof(buffer) - 2) {
-                buffer[offset++] = board->board[idx].content;
+                char c = ' ';
+                if (is_wall(board, x, y)) c = 'W';
+                else if (ghost_at(board, x, y) >= 0) c = 'M';
+                else if (pacman_at(board, x, y) >= 0) c = 'P';
+                buffer[offset++] = c;
             }
         }
         if (offset < sizeof(buffer) - 2) {
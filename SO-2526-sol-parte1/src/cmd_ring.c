@@ -0,0 +1,43 @@
+#include "cmd_ring.h"
+#include <string.h>
+
+int cmd_ring_push(cmd_ring_t* ring, char command, uint64_t received_ns) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == CMD_RING_SIZE) {
+        ring->dropped++;
+        return -1;
+    }
+
+    timed_command_t *slot = &ring->slots[head % CMD_RING_SIZE];
+    slot->command = command;
+    slot->received_ns = received_ns;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+int cmd_ring_pop(cmd_ring_t* ring, input_mode_t mode, timed_command_t* out) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return 0;
+
+    if (mode == INPUT_LATEST) {
+        ring->skipped += head - tail - 1;
+        tail = head - 1;
+    }
+    *out = ring->slots[tail % CMD_RING_SIZE];
+    tail++;
+
+    if (mode == INPUT_ONE_AHEAD && head - tail > 1) {
+        ring->skipped += head - tail - 1;
+        tail = head - 1;
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    return 1;
+}
+
+int parse_input_mode(const char* name) {
+    if (strcmp(name, "latest") == 0) return INPUT_LATEST;
+    if (strcmp(name, "all") == 0) return INPUT_QUEUE_ALL;
+    if (strcmp(name, "ahead") == 0) return INPUT_ONE_AHEAD;
+    return -1;
+}
@@ -0,0 +1,130 @@
+#include "frame.h"
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+void encoder_init(frame_encoder_t* enc, int keyframe_interval) {
+    enc->width = 0;
+    enc->height = 0;
+    enc->prev = NULL;
+    enc->next = NULL;
+    enc->seq = 0;
+    enc->since_keyframe = 0;
+    enc->keyframe_interval = keyframe_interval < 1 ? 1 : keyframe_interval;
+    enc->force_keyframe = 1;
+}
+
+void encoder_destroy(frame_encoder_t* enc) {
+    free(enc->prev);
+    free(enc->next);
+    enc->prev = NULL;
+    enc->next = NULL;
+}
+
+char* encoder_grid(frame_encoder_t* enc, int width, int height) {
+    if (width != enc->width || height != enc->height) {
+        free(enc->prev);
+        free(enc->next);
+        enc->prev = malloc(width * height);
+        enc->next = malloc(width * height);
+        enc->width = width;
+        enc->height = height;
+        enc->force_keyframe = 1;
+    }
+    return enc->next;
+}
+
+void encoder_force_keyframe(frame_encoder_t* enc) {
+    enc->force_keyframe = 1;
+}
+
+static frame_t* encode_keyframe(frame_encoder_t* enc, const char* grid, int tempo, int points) {
+    int size = enc->width * enc->height;
+    frame_t *frame = frame_alloc(sizeof(msg_board_header_t) + size);
+    if (!frame) return NULL;
+
+    msg_board_header_t head;
+    head.op_code = OP_CODE_BOARD;
+    head.width = enc->width;
+    head.height = enc->height;
+    head.tempo = tempo;
+    head.accumulated_points = points;
+    head.victory = 0;
+    head.game_over = 0;
+    head.seq = enc->seq;
+    memcpy(frame->data, &head, sizeof(head));
+    memcpy(frame->data + sizeof(head), grid, size);
+    return frame;
+}
+
+// Returns NULL if the delta would not be smaller than a keyframe
+static frame_t* encode_delta(frame_encoder_t* enc, int tempo, int points) {
+    int size = enc->width * enc->height;
+    int max_cells = (int)((sizeof(msg_board_header_t) + size - sizeof(msg_board_delta_t)) / sizeof(msg_board_cell_t));
+
+    int n_cells = 0;
+    for (int i = 0; i < size; i++) {
+        if (enc->next[i] != enc->prev[i] && ++n_cells >= max_cells) return NULL;
+    }
+
+    frame_t *frame = frame_alloc(sizeof(msg_board_delta_t) + n_cells * sizeof(msg_board_cell_t));
+    if (!frame) return NULL;
+
+    msg_board_delta_t head;
+    head.op_code = OP_CODE_BOARD_DELTA;
+    head.seq = enc->seq;
+    head.tempo = tempo;
+    head.victory = 0;
+    head.game_over = 0;
+    head.accumulated_points = points;
+    head.n_cells = n_cells;
+    memcpy(frame->data, &head, sizeof(head));
+
+    msg_board_cell_t *cells = (msg_board_cell_t*)(frame->data + sizeof(head));
+    int c = 0;
+    for (int i = 0; i < size && c < n_cells; i++) {
+        if (enc->next[i] != enc->prev[i]) {
+            msg_board_cell_t cell = { .index = i, .glyph = enc->next[i] };
+            memcpy(&cells[c++], &cell, sizeof(cell));
+        }
+    }
+    return frame;
+}
+
+frame_t* encoder_encode(frame_encoder_t* enc, int tempo, int points) {
+    if (!enc->next) return NULL;
+
+    enc->seq++;
+    frame_t *frame = NULL;
+    if (!enc->force_keyframe && enc->since_keyframe < enc->keyframe_interval - 1) {
+        frame = encode_delta(enc, tempo, points);
+        if (frame) enc->since_keyframe++;
+    }
+    if (!frame) {
+        frame = encode_keyframe(enc, enc->next, tempo, points);
+        if (!frame) {
+            enc->seq--;
+            return NULL;
+        }
+        enc->since_keyframe = 0;
+        enc->force_keyframe = 0;
+    }
+
+    char *tmp = enc->prev;
+    enc->prev = enc->next;
+    enc->next = tmp;
+    return frame;
+}
+
+frame_t* encoder_keyframe(frame_encoder_t* enc, int tempo, int points) {
+    if (!enc->prev || enc->seq == 0) return NULL;
+    return encode_keyframe(enc, enc->prev, tempo, points); // the grid encode just swapped in
+}
+
+void render_board(board_t* board, char* grid) {
+    for(int y=0; y<board->height; y++) {
+        for(int x=0; x<board->width; x++) {
+             grid[y*board->width + x] = cell_glyph(board, x, y);
+        }
+    }
+}
@@ -1,13 +1,21 @@
 #include "board.h"
 #include "display.h" 
 #include "protocol.h"
+#include "scheduler.h"
+#include "io_loop.h"
+#include "outqueue.h"
+#include "frame.h"
+#include "level_cache.h"
+#include "replay.h"
+#include "shm_ring.h"
+#include "cmd_ring.h"
+#include "snapshot.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <pthread.h>
@@ -16,17 +24,35 @@
 #include <semaphore.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 
 #define CONTINUE_PLAY 0
 #define NEXT_LEVEL 1
 #define QUIT_GAME 2
 
+#define GAME_OVER_DRAIN_MS 1000 // how long a finishing session waits for a slow client
+#define CONNECT_TIMEOUT_MS 5000 // how long a new session waits for the client to open its pipes
+#define CONNECT_RETRY_MS 10
+#define MAX_WAITING_CONNECTS 256 // connect requests read off the register FIFO, waiting for a slot
+
 // Global settings
 char LEVELS_DIR[256];
 int MAX_GAMES;
 char REGISTER_FIFO[256];
+int TICK_ENGINE = 0; // -t: sessions run as tick engine tasks on the worker pool
+int N_WORKERS = 0; // -w: worker pool size, 0 means one per core
+int NOTIF_QUEUE_LEN = 4; // -q: frames buffered per client before dropping
+drop_policy_t DROP_POLICY = DROP_OLDEST; // -d: which frame a full queue drops
+int KEYFRAME_INTERVAL = 50; // -k: a full board every this many frames, deltas in between
+long HEADLESS_TICKS = 0; // -s: simulate this many ticks per session without clients or sleeps
+char REPLAY_DIR[256] = ""; // -l: tick engine sessions log their inputs here for -r
+uint64_t BASE_SEED = 0; // -S: sessions are seeded from this and their id, 0 means from the clock
+input_mode_t INPUT_MODE = INPUT_LATEST; // -i: which of the queued commands a pacman turn plays
+int LOW_LATENCY = 0; // -L: a key arriving when pacman's turn is due is played and sent at once
 
 sem_t available_slots;
+int slot_released_fd; // eventfd, resumes accepting connections when a slot frees
 
 // Global sessions registry for Signal Handler
 struct {
@@ -34,17 +60,69 @@ struct {
     pthread_mutex_t lock;
 } registry;
 
+// Per level scheduling state of the tick engine. An entity acts on the ticks
+// where its countdown is zero, i.e. once every (1 + passo) ticks, which is the
+// same cadence the per entity threads get from sleeping tempo * (1 + passo).
+typedef struct {
+    unsigned long tick;
+    unsigned long moves; // entity moves carried out, for the headless report
+    int pacman_countdown;
+    int ghost_countdown[MAX_GHOSTS];
+} tick_state_t;
+
+// Where a session is in its life cycle, see session_step
+typedef enum {
+    SESSION_CONNECTING,
+    SESSION_LOADING,
+    SESSION_PLAYING,
+    SESSION_LEVEL_DONE,
+    SESSION_FINISHED,
+} session_phase_t;
+
+// Extra notification pipe watching a session, see OP_CODE_SPECTATE
+typedef struct spectator {
+    outqueue_t notif; // same frames as the player's, the fd is notif.fd
+    int resync; // joined or lost a frame, gets a keyframe instead of the next delta
+    struct spectator *next;
+} spectator_t;
+
 typedef struct {
     int id;
     int req_fd;
     int notif_fd;
-    char last_command;
+    outqueue_t notif; // frames waiting to be written to notif_fd
+    frame_encoder_t encoder;
+    int use_shm; // the client asked for frames through shared memory
+    shm_ring_t *ring; // NULL until the first frame, replaced when frames outgrow it
+    char ring_name[MAX_SHM_NAME_LENGTH];
+    int ring_gen;
+    cmd_ring_t input; // commands read from the client, waiting for pacman's turn
+    unsigned long inputs_played;
+    uint64_t input_wait_ns; // total time played commands spent queued
     int client_connected;
+    atomic_ulong deadlines_missed; // steps that started a whole period late, a sign of overload
+    uint64_t tick_deadline_ns; // when the next tick engine step is due
+    uint64_t connect_deadline_ns; // session_connect gives up on the client after this
     board_t board;
-    pthread_mutex_t cmd_mutex;
-    pthread_mutex_t session_mutex;
+    board_snapshot_t snapshot; // what frames and the dump are built from, see session_move_pacman
+    pthread_mutex_t send_lock; // notif_thread and a low latency pacman both send frames
+    pthread_mutex_t session_mutex; // with input_ready, wakes a low latency pacman thread
+    pthread_cond_t input_ready;
+    spectator_t *spectators; // only the thread sending frames touches them
+    int n_spectators;
+    spectator_t *joining; // handed over by the I/O thread under spectators_lock
+    pthread_mutex_t spectators_lock;
     char req_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
     char notif_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
+    session_phase_t phase;
+    int next_level; // index in the level cache
+    int level; // cache index of the level being played
+    uint64_t seed; // seeds the random stream of every level, see session_load_next_level
+    int log_fd; // input log for replays, -1 when not logging
+    int accumulated_points;
+    tick_state_t ticks;
+    char in_buf[sizeof(msg_play_t)]; // partial request read by the I/O thread
+    int in_len;
 } game_session_t;
 
 typedef struct {
@@ -55,103 +133,308 @@ typedef struct {
 typedef struct {
     game_session_t *session;
     int ghost_index;
-    int *shutdown_flag;
+    atomic_int *shutdown_flag;
+    uint64_t start_ns; // level start, every thread keeps its deadlines in phase with it
 } thread_arg_t;
 
-void send_board(game_session_t* session, board_t* board) {
-    if (!session->client_connected) return;
-
-    msg_board_header_t head;
-    head.op_code = OP_CODE_BOARD;
-    head.width = board->width;
-    head.height = board->height;
-    head.tempo = board->tempo;
-    head.accumulated_points = board->pacmans[0].points;
-    head.victory = 0;
-    head.game_over = 0; 
-
-    ssize_t w = write(session->notif_fd, &head, sizeof(head));
-    if (w < 0) {
+// Queues a small control message on the notification pipe
+static void send_message(game_session_t* session, const void* msg, size_t size) {
+    frame_t *frame = frame_alloc(size);
+    if (!frame) return;
+    memcpy(frame->data, msg, size);
+    if (outqueue_push(&session->notif, frame) == -1) {
         session->client_connected = 0;
-        return;
     }
+}
 
-    int size = board->width * board->height;
-    char *data = malloc(size);
-    if (!data) return;
+// Moves the session to a ring whose slots hold frame_size bytes. Returns 0 once
+// attached, 1 if the client is still reading the old ring or the pipe and -1
+// if shared memory can't be used.
+static int session_attach_ring(game_session_t* session, size_t frame_size) {
+    if (session->ring && !shm_ring_empty(session->ring)) return 1;
+    if (session->notif.count > 0) return 1; // the attach must not be dropped
+
+    shm_ring_destroy(session->ring, session->ring_name);
+    snprintf(session->ring_name, sizeof(session->ring_name), "/pacman-%d-%d-%d", getpid(), session->id, session->ring_gen++);
+    session->ring = shm_ring_create(session->ring_name, NOTIF_QUEUE_LEN, frame_size);
+    if (!session->ring) {
+        debug("Session %d can't create shared memory %s\n", session->id, session->ring_name);
+        return -1;
+    }
 
-    for(int y=0; y<board->height; y++) {
-        for(int x=0; x<board->width; x++) {
-             board_pos_t *pos = &board->board[y*board->width + x];
-             char c = ' ';
-             if (pos->content == 'W') c = '#';
-             else if (pos->has_portal) c = '@'; 
-             else if (pos->has_dot) c = '.';
-             data[y*board->width + x] = c;
+    msg_shm_attach_t msg = {0};
+    msg.op_code = OP_CODE_SHM_ATTACH;
+    strncpy(msg.name, session->ring_name, MAX_SHM_NAME_LENGTH - 1);
+    send_message(session, &msg, sizeof(msg));
+    return 0;
+}
+
+// Publishes a frame in the session ring. Returns -1 if it has to go through the pipe.
+static int send_frame_shm(game_session_t* session, frame_t* frame) {
+    if (!session->ring || frame->size > session->ring->slot_size) {
+        int attached = session_attach_ring(session, frame->size);
+        if (attached == -1) {
+            session->use_shm = 0; // the pipe carries every frame from now on
+            return -1;
+        }
+        if (attached == 1) {
+            frame_release(frame);
+            session->notif.dropped++;
+            encoder_force_keyframe(&session->encoder);
+            return 0;
         }
     }
-    
-    for(int i=0; i<board->n_pacmans; i++) {
-        if(board->pacmans[i].alive) {
-            int idx = board->pacmans[i].pos_y * board->width + board->pacmans[i].pos_x;
-            if(idx < size) data[idx] = 'C';
+
+    int published = shm_ring_publish(session->ring, frame->data, frame->size);
+    frame_release(frame);
+    if (published == -1) {
+        session->notif.dropped++;
+        encoder_force_keyframe(&session->encoder); // deltas only apply on top of the previous frame
+    }
+    // a message still queued on the pipe wakes the client as well
+    else if (published == 1 && session->notif.count == 0) {
+        msg_shm_wake_t msg = {OP_CODE_SHM_WAKE};
+        send_message(session, &msg, sizeof(msg));
+    }
+    return 0;
+}
+
+static void spectator_close(spectator_t *spectator) {
+    outqueue_destroy(&spectator->notif);
+    close(spectator->notif.fd);
+    free(spectator);
+}
+
+// Queues the frame the player gets on every spectator's pipe. The frame is
+// shared, not copied, and the keyframe for those that joined or lost a frame
+// is encoded at most once, so a frame costs the same however many watch.
+static void send_spectators(game_session_t* session, frame_t* frame, int tempo, int points) {
+    pthread_mutex_lock(&session->spectators_lock);
+    while (session->joining) {
+        spectator_t *spectator = session->joining;
+        session->joining = spectator->next;
+        spectator->next = session->spectators;
+        session->spectators = spectator;
+        session->n_spectators++;
+    }
+    pthread_mutex_unlock(&session->spectators_lock);
+
+    int op_code;
+    memcpy(&op_code, frame->data, sizeof(op_code));
+    frame_t *keyframe = op_code == OP_CODE_BOARD ? frame_ref(frame) : NULL;
+
+    spectator_t **link = &session->spectators;
+    while (*link) {
+        spectator_t *spectator = *link;
+        frame_t *send = frame;
+        if (spectator->resync) {
+            if (!keyframe) keyframe = encoder_keyframe(&session->encoder, tempo, points);
+            if (!keyframe) {
+                link = &spectator->next;
+                continue;
+            }
+            send = keyframe;
+        }
+
+        unsigned long dropped = spectator->notif.dropped;
+        if (outqueue_push(&spectator->notif, frame_ref(send)) == -1) {
+            *link = spectator->next;
+            session->n_spectators--;
+            spectator_close(spectator);
+            debug("Spectator left session %d, %d watching\n", session->id, session->n_spectators);
+            continue;
+        }
+        // deltas only apply on top of the previous frame
+        spectator->resync = spectator->notif.dropped != dropped;
+        link = &spectator->next;
+    }
+    frame_release(keyframe);
+    atomic_store_explicit(&session->snapshot.spectators, session->n_spectators, memory_order_relaxed);
+}
+
+// Queues game_over on every spectator's pipe, if any, and closes them. Must run
+// after unregister_session, when no more spectators can join.
+static void spectators_close(game_session_t* session, frame_t* game_over) {
+    spectator_t *spectator = session->spectators;
+    while (spectator || session->joining) {
+        if (!spectator) {
+            spectator = session->joining;
+            session->joining = NULL;
         }
+        spectator_t *next = spectator->next;
+        if (game_over) outqueue_push(&spectator->notif, frame_ref(game_over));
+        spectator_close(spectator);
+        spectator = next;
     }
-    for(int i=0; i<board->n_ghosts; i++) {
-        int idx = board->ghosts[i].pos_y * board->width + board->ghosts[i].pos_x;
-        if(idx < size) data[idx] = 'M';
+    session->spectators = NULL;
+    session->n_spectators = 0;
+    pthread_mutex_destroy(&session->spectators_lock);
+}
+
+// Queues the board snapshot on the session's notification pipe, and its
+// spectators' ones, without blocking
+void send_board(game_session_t* session) {
+    if (!session->client_connected) return;
+
+    board_snapshot_t *snap = &session->snapshot;
+    int points = snapshot_read(snap, encoder_grid(&session->encoder, snap->width, snap->height));
+    frame_t *frame = encoder_encode(&session->encoder, snap->tempo, points);
+    if (!frame) return;
+    send_spectators(session, frame, snap->tempo, points);
+    if (session->use_shm && send_frame_shm(session, frame) == 0) {
+        atomic_store_explicit(&snap->dropped, session->notif.dropped, memory_order_relaxed);
+        return;
     }
 
-    write(session->notif_fd, data, size);
-    free(data);
+    unsigned long dropped = session->notif.dropped;
+    if (outqueue_push(&session->notif, frame) == -1) {
+        session->client_connected = 0;
+    }
+    // deltas only apply on top of the previous frame
+    if (session->notif.dropped != dropped) {
+        encoder_force_keyframe(&session->encoder);
+        atomic_store_explicit(&snap->dropped, session->notif.dropped, memory_order_relaxed);
+    }
 }
 
 
 void* notif_thread(void *arg) {
     thread_arg_t *targ = (thread_arg_t*) arg;
     game_session_t *session = targ->session;
-    board_t *board = &session->board;
-    int *shutdown = targ->shutdown_flag;
+    atomic_int *shutdown = targ->shutdown_flag;
+    uint64_t deadline = targ->start_ns;
 
     while (true) {
-        sleep_ms(board->tempo);
-        
-        pthread_rwlock_rdlock(&board->state_lock);
-        if (*shutdown) {
-            pthread_rwlock_unlock(&board->state_lock);
-            break;
-        }
-        
-        send_board(session, board);
-        
-        pthread_rwlock_unlock(&board->state_lock);
+        session->deadlines_missed += next_deadline(&deadline, session->snapshot.tempo);
+        sleep_until(deadline);
+        if (*shutdown) break;
+
+        // reads the snapshot, the movers never wait for a frame to be encoded
+        pthread_mutex_lock(&session->send_lock);
+        send_board(session);
+        pthread_mutex_unlock(&session->send_lock);
 
         if (!session->client_connected) break;
     }
     return NULL;
 }
 
-void* input_thread(void *arg) {
+// Size of a request on the request pipe given its op code, 0 if it is not valid
+static size_t request_size(int op_code) {
+    switch (op_code) {
+        case OP_CODE_PLAY: return sizeof(msg_play_t);
+        case OP_CODE_DISCONNECT: return sizeof(msg_disconnect_t);
+        default: return 0;
+    }
+}
+
+// I/O thread handler for a session's request pipe: drains it and applies every
+// complete request. A closed pipe or a malformed request disconnects the client.
+static void session_input(int fd, void *arg) {
     game_session_t *session = (game_session_t*) arg;
-    
-    while(session->client_connected) {
-        msg_play_t msg; 
-        ssize_t r = read(session->req_fd, &msg, sizeof(msg));
+
+    while (session->client_connected) {
+        ssize_t r = read(fd, session->in_buf + session->in_len, sizeof(session->in_buf) - session->in_len);
+        if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+            if (errno == EAGAIN) return;
+            continue;
+        }
         if (r <= 0) {
             session->client_connected = 0;
-            break;
+            return;
         }
-        
-        if (msg.op_code == OP_CODE_PLAY) {
-            pthread_mutex_lock(&session->cmd_mutex);
-            session->last_command = msg.command;
-            pthread_mutex_unlock(&session->cmd_mutex);
-        } else if (msg.op_code == OP_CODE_DISCONNECT) {
-            session->client_connected = 0;
-            break;
+        session->in_len += r;
+
+        while (session->in_len >= (int)sizeof(int)) {
+            int op_code;
+            memcpy(&op_code, session->in_buf, sizeof(int));
+            size_t size = request_size(op_code);
+            if (size == 0 || op_code == OP_CODE_DISCONNECT) {
+                session->client_connected = 0;
+                return;
+            }
+            if (session->in_len < (int)size) break;
+
+            msg_play_t msg;
+            memcpy(&msg, session->in_buf, sizeof(msg));
+            cmd_ring_push(&session->input, msg.command, monotonic_ns());
+            if (LOW_LATENCY) {
+                pthread_mutex_lock(&session->session_mutex);
+                pthread_cond_signal(&session->input_ready);
+                pthread_mutex_unlock(&session->session_mutex);
+            }
+
+            session->in_len -= size;
+            memmove(session->in_buf, session->in_buf + size, session->in_len);
         }
     }
-    return NULL;
+}
+
+// Fetches pacman's next command: the queued key INPUT_MODE picks in interactive
+// mode or the next scripted move. Returns NULL if there is nothing to play.
+static command_t* next_pacman_command(game_session_t *session, command_t *buf) {
+    pacman_t* pacman = &session->board.pacmans[0];
+
+    if (pacman->n_moves == 0) { // Interactive mode
+        timed_command_t input;
+        if (!cmd_ring_pop(&session->input, INPUT_MODE, &input)) return NULL;
+        session->inputs_played++;
+        session->input_wait_ns += monotonic_ns() - input.received_ns;
+
+        buf->command = input.command;
+        buf->turns = 1;
+        return buf;
+    }
+    return &pacman->moves[pacman->current_move%pacman->n_moves];
+}
+
+// Low latency pacman turn: sleeps until the turn is due at due_ns, then returns
+// as soon as session_input queues a key. Returns NULL after a tempo without
+// keys, so the caller gets to check whether the game is still on.
+static command_t* wait_pacman_command(game_session_t *session, uint64_t due_ns, command_t *buf) {
+    sleep_until(due_ns);
+
+    pthread_mutex_lock(&session->session_mutex);
+    command_t *play = next_pacman_command(session, buf);
+    if (!play && session->client_connected) {
+        uint64_t until = monotonic_ns() + (uint64_t)session->board.tempo * 1000000;
+        struct timespec ts = { .tv_sec = until / 1000000000, .tv_nsec = until % 1000000000 };
+        pthread_cond_timedwait(&session->input_ready, &session->session_mutex, &ts);
+        play = next_pacman_command(session, buf);
+    }
+    pthread_mutex_unlock(&session->session_mutex);
+    return play;
+}
+
+// Moves pacman and renders into the snapshot every cell the move can change:
+// where it stood and the four it can step to, a portal it stepped on included
+static int session_move_pacman(game_session_t *session, command_t *play) {
+    board_t *board = &session->board;
+    int x = board->pacmans[0].pos_x, y = board->pacmans[0].pos_y;
+    int result = move_pacman(board, 0, play);
+
+    int cells[] = { x, y, x + 1, y, x - 1, y, x, y + 1, x, y - 1 };
+    snapshot_update(&session->snapshot, board, cells, 5);
+    return result;
+}
+
+// Moves a ghost and renders into the snapshot the cells it left and reached,
+// which is also where it catches pacman
+static void session_move_ghost(game_session_t *session, int ghost_index) {
+    ghost_t *ghost = &session->board.ghosts[ghost_index];
+    int cells[4] = { ghost->pos_x, ghost->pos_y };
+    move_ghost(&session->board, ghost_index, &ghost->moves[ghost->current_move%ghost->n_moves]);
+
+    cells[2] = ghost->pos_x;
+    cells[3] = ghost->pos_y;
+    snapshot_update(&session->snapshot, &session->board, cells, 2);
+}
+
+// Maps the outcome of move_pacman to the session level result
+static int pacman_result(int move_result) {
+    if (move_result == REACHED_PORTAL) return NEXT_LEVEL;
+    if (move_result == DEAD_PACMAN) return QUIT_GAME;
+    return CONTINUE_PLAY;
 }
 
 void* pacman_thread(void *arg) {
@@ -162,6 +445,10 @@ void* pacman_thread(void *arg) {
     *retval = QUIT_GAME; 
 
     pacman_t* pacman = &board->pacmans[0];
+    int low_latency = LOW_LATENCY && pacman->n_moves == 0;
+    uint64_t turn_ns = (uint64_t)board->tempo * (1 + pacman->passo) * 1000000;
+    uint64_t due_ns = targ->start_ns + turn_ns;
+    uint64_t deadline = targ->start_ns;
 
     while (session->client_connected) {
         if(!pacman->alive) {
@@ -169,26 +456,16 @@ void* pacman_thread(void *arg) {
             return (void*) retval;
         }
 
-        sleep_ms(board->tempo * (1 + pacman->passo));
-
-        command_t* play;
         command_t c;
-        if (pacman->n_moves == 0) { // Interactive mode
-            pthread_mutex_lock(&session->cmd_mutex);
-            c.command = session->last_command;
-            session->last_command = 0; // Consume
-            pthread_mutex_unlock(&session->cmd_mutex);
-
-            if(c.command == 0) {
-                continue;
-            }
-
-            c.turns = 1;
-            play = &c;
-        }
-        else {
-            play = &pacman->moves[pacman->current_move%pacman->n_moves];
+        command_t* play;
+        if (low_latency) {
+            play = wait_pacman_command(session, due_ns, &c);
+        } else {
+            session->deadlines_missed += next_deadline(&deadline, board->tempo * (1 + pacman->passo));
+            sleep_until(deadline);
+            play = next_pacman_command(session, &c);
         }
+        if (!play) continue;
 
         if (play->command == 'Q') {
             *retval = QUIT_GAME;
@@ -196,35 +473,37 @@ void* pacman_thread(void *arg) {
         }
 
         pthread_rwlock_wrlock(&board->state_lock);
+        int result = pacman_result(session_move_pacman(session, play));
+        pthread_rwlock_unlock(&board->state_lock);
 
-        int result = move_pacman(board, 0, play);
-        if (result == REACHED_PORTAL) {
-            *retval = NEXT_LEVEL;
-            pthread_rwlock_unlock(&board->state_lock);
-            break;
+        if (low_latency) {
+            pthread_mutex_lock(&session->send_lock);
+            send_board(session);
+            pthread_mutex_unlock(&session->send_lock);
         }
+        due_ns = monotonic_ns() + turn_ns;
 
-        if(result == DEAD_PACMAN) {
-            *retval = QUIT_GAME;
-            pthread_rwlock_unlock(&board->state_lock);
+        if (result != CONTINUE_PLAY) {
+            *retval = result;
             break;
         }
-
-        pthread_rwlock_unlock(&board->state_lock);
     }
     return (void*) retval;
 }
 
 void* server_ghost_thread(void *arg) {
     thread_arg_t *targ = (thread_arg_t*) arg;
-    board_t *board = &targ->session->board;
+    game_session_t *session = targ->session;
+    board_t *board = &session->board;
     int ghost_ind = targ->ghost_index;
-    int *shutdown = targ->shutdown_flag;
+    atomic_int *shutdown = targ->shutdown_flag;
 
     ghost_t* ghost = &board->ghosts[ghost_ind];
+    uint64_t deadline = targ->start_ns;
 
     while (true) {
-        sleep_ms(board->tempo * (1 + ghost->passo));
+        session->deadlines_missed += next_deadline(&deadline, board->tempo * (1 + ghost->passo));
+        sleep_until(deadline);
 
         pthread_rwlock_wrlock(&board->state_lock);
         if (*shutdown) {
@@ -232,88 +511,103 @@ void* server_ghost_thread(void *arg) {
             return NULL;
         }
         
-        move_ghost(board, ghost_ind, &ghost->moves[ghost->current_move%ghost->n_moves]);
+        session_move_ghost(session, ghost_ind);
         pthread_rwlock_unlock(&board->state_lock);
     }
     return NULL;
 }
 
-void run_game_session(game_session_t *session) {
-    DIR* level_dir = opendir(LEVELS_DIR);
-    if (!level_dir) return;
+// Runs one level attempt with a thread per entity plus a notification thread.
+// Returns NEXT_LEVEL or QUIT_GAME.
+static int run_level_threaded(game_session_t *session) {
+    pthread_t notif_tid, pacman_tid;
+    pthread_t *ghost_tids = malloc(session->board.n_ghosts * sizeof(pthread_t));
+    thread_arg_t *ghost_args = malloc(session->board.n_ghosts * sizeof(thread_arg_t));
+    atomic_int shutdown = 0;
 
-    int accumulated_points = 0;
-    bool end_game = false;
-    struct dirent* entry;
+    thread_arg_t common_arg = { .session = session, .shutdown_flag = &shutdown, .start_ns = monotonic_ns() };
 
-    pthread_t input_tid;
-    pthread_create(&input_tid, NULL, input_thread, session);
-    
-    while ((entry = readdir(level_dir)) != NULL && !end_game && session->client_connected) {
-        if (entry->d_name[0] == '.') continue;
-        char *dot = strrchr(entry->d_name, '.');
-        if (!dot || strcmp(dot, ".lvl") != 0) continue;
+    pthread_create(&pacman_tid, NULL, pacman_thread, &common_arg);
 
-        load_level(&session->board, entry->d_name, LEVELS_DIR, accumulated_points);
-        
-        while(session->client_connected) {
-            pthread_t notif_tid, pacman_tid;
-            pthread_t *ghost_tids = malloc(session->board.n_ghosts * sizeof(pthread_t));
-            int shutdown = 0;
-            
-            thread_arg_t common_arg = { .session = session, .shutdown_flag = &shutdown };
-            
-            pthread_create(&pacman_tid, NULL, pacman_thread, &common_arg);
-            
-            for (int i = 0; i < session->board.n_ghosts; i++) {
-                thread_arg_t *garg = malloc(sizeof(thread_arg_t));
-                *garg = common_arg;
-                garg->ghost_index = i;
-                pthread_create(&ghost_tids[i], NULL, server_ghost_thread, garg);
-            }
-            pthread_create(&notif_tid, NULL, notif_thread, &common_arg);
+    for (int i = 0; i < session->board.n_ghosts; i++) {
+        ghost_args[i] = common_arg;
+        ghost_args[i].ghost_index = i;
+        pthread_create(&ghost_tids[i], NULL, server_ghost_thread, &ghost_args[i]);
+    }
+    pthread_create(&notif_tid, NULL, notif_thread, &common_arg);
 
-            int *retval;
-            pthread_join(pacman_tid, (void**)&retval); // Wait for Pacman logic to end level/game
-            int result = *retval;
-            free(retval);
+    int *retval;
+    pthread_join(pacman_tid, (void**)&retval); // Wait for Pacman logic to end level/game
+    int result = *retval;
+    free(retval);
 
-            pthread_rwlock_wrlock(&session->board.state_lock);
-            shutdown = 1;
-            pthread_rwlock_unlock(&session->board.state_lock);
+    pthread_rwlock_wrlock(&session->board.state_lock);
+    shutdown = 1;
+    pthread_rwlock_unlock(&session->board.state_lock);
 
-            pthread_join(notif_tid, NULL);
-            for(int i=0; i<session->board.n_ghosts; i++) pthread_join(ghost_tids[i], NULL);
-            free(ghost_tids);
+    pthread_join(notif_tid, NULL);
+    for(int i=0; i<session->board.n_ghosts; i++) pthread_join(ghost_tids[i], NULL);
+    free(ghost_tids);
+    free(ghost_args);
 
-            if(result == NEXT_LEVEL) {
-                 send_board(session, &session->board); 
-                 sleep_ms(session->board.tempo);
-                 break; 
-            }
+    return result;
+}
+
+static void tick_state_init(tick_state_t *ts, board_t *board) {
+    ts->tick = 0;
+    ts->moves = 0;
+    ts->pacman_countdown = board->pacmans[0].passo;
+    for (int i = 0; i < board->n_ghosts; i++) {
+        ts->ghost_countdown[i] = board->ghosts[i].passo;
+    }
+}
+
+// Returns 1 if the entity acts on this tick and rearms its countdown
+static inline int tick_due(int *countdown, int passo) {
+    if (*countdown > 0) {
+        *countdown -= 1;
+        return 0;
+    }
+    *countdown = passo;
+    return 1;
+}
+
+// Advances the level by one tick: pacman, then every ghost in index order, then
+// the frame for the client. Only the engine touches the board, so no board locks
+// are taken. Returns CONTINUE_PLAY, NEXT_LEVEL or QUIT_GAME.
+static int session_tick(game_session_t *session, tick_state_t *ts) {
+    board_t *board = &session->board;
+    pacman_t *pacman = &board->pacmans[0];
+
+    ts->tick++;
 
-            if(result == QUIT_GAME) {
-                 end_game = true;
-                 break;
+    if (tick_due(&ts->pacman_countdown, pacman->passo)) {
+        command_t c;
+        command_t *play = next_pacman_command(session, &c);
+        if (play) {
+            // scripted moves replay by themselves, only the client's need logging
+            if (session->log_fd != -1 && pacman->n_moves == 0) {
+                replay_append(session->log_fd, REPLAY_INPUT, session->level, ts->tick, play->command, 0);
             }
-            
-            accumulated_points = session->board.pacmans[0].points;
+            if (play->command == 'Q') return QUIT_GAME;
+
+            ts->moves++;
+            int result = pacman_result(session_move_pacman(session, play));
+            if (result != CONTINUE_PLAY) return result;
         }
-        
-        unload_level(&session->board);
     }
-    
-    if (session->client_connected) {
-        msg_board_header_t head = {0};
-        head.op_code = OP_CODE_BOARD;
-        head.game_over = 1;
-        write(session->notif_fd, &head, sizeof(head));
+
+    for (int i = 0; i < board->n_ghosts; i++) {
+        ghost_t *ghost = &board->ghosts[i];
+        if (tick_due(&ts->ghost_countdown[i], ghost->passo)) {
+            ts->moves++;
+            session_move_ghost(session, i);
+        }
     }
 
-    session->client_connected = 0;
-    pthread_join(input_tid, NULL);
-    
-    closedir(level_dir);
+    send_board(session);
+
+    return pacman->alive ? CONTINUE_PLAY : QUIT_GAME;
 }
 
 void unregister_session(game_session_t *session) {
@@ -326,6 +620,9 @@ void unregister_session(game_session_t *session) {
     }
     pthread_mutex_unlock(&registry.lock);
     sem_post(&available_slots);
+
+    uint64_t one = 1;
+    write(slot_released_fd, &one, sizeof(one));
 }
 
 void signal_handler(int signum) {
@@ -340,84 +637,748 @@ void signal_handler(int signum) {
         game_session_t *s = (game_session_t*) registry.sessions[i];
         if (s) {
             dprintf(fd, "Game ID: %d\n", s->id);
-            board_t *b = &s->board;
-            dprintf(fd, "Level: %s, Size: %dx%d\n", b->level_name, b->width, b->height);
-            
-            for (int y=0; y<b->height; y++) {
-                for (int x=0; x<b->width; x++) {
-                    char c = ' ';
-                    if (b->board[y*b->width + x].content == 'W') c = '#';
-                    else if (b->board[y*b->width + x].has_portal) c = '@';
-                    else if (b->board[y*b->width + x].has_dot) c = '.';
-
-                    for(int k=0; k<b->n_pacmans; k++) 
-                        if (b->pacmans[k].alive && b->pacmans[k].pos_x == x && b->pacmans[k].pos_y == y) c = 'C';
-                    for(int k=0; k<b->n_ghosts; k++) 
-                        if (b->ghosts[k].pos_x == x && b->ghosts[k].pos_y == y) c = 'M';
-                    write(fd, &c, 1);
+            // the snapshot, never the live session: this may have interrupted a mover
+            board_snapshot_t *b = &s->snapshot;
+            unsigned seq = snapshot_begin(b);
+            int width = b->width, height = b->height;
+            dprintf(fd, "Level: %.*s, Size: %dx%d\n", (int)sizeof(b->level_name) - 1, b->level_name, width, height);
+            dprintf(fd, "Dropped frames: %lu\n", atomic_load_explicit(&b->dropped, memory_order_relaxed));
+            dprintf(fd, "Missed deadlines: %lu\n", (unsigned long) s->deadlines_missed);
+            dprintf(fd, "Spectators: %d\n", atomic_load_explicit(&b->spectators, memory_order_relaxed));
+
+            // a torn width and height may not fit, the grid itself never moves
+            if (b->grid && width > 0 && height > 0 && (size_t)width * height <= b->capacity) {
+                char line[256];
+                size_t len = 0;
+                for (int y=0; y<height; y++) {
+                    for (int x=0; x<width; x++) {
+                        line[len++] = b->grid[y * width + x];
+                        if (len == sizeof(line) - 1) {
+                            write(fd, line, len);
+                            len = 0;
+                        }
+                    }
+                    line[len++] = '\n';
                 }
-                write(fd, "\n", 1);
+                write(fd, line, len);
             }
+            if (snapshot_retry(b, seq)) dprintf(fd, "(the board moved while it was dumped)\n");
             dprintf(fd, "\n");
         }
     }
     close(fd);
 }
 
-void* game_worker(void* arg) {
-    game_session_t *session = (game_session_t*) arg;
-    
-    debug("Starting session %d, waiting for client pipes...\n", session->id);
-    
-    // Connect to client pipes
-    session->notif_fd = open(session->notif_pipe_path, O_WRONLY);
+// Opens the client pipes. Returns 0 once connected, 1 if the client has not
+// opened its notification pipe yet and -1 on failure. The opens never block, a
+// client that registers and never shows up must not hold a pool worker.
+static int session_connect(game_session_t *session) {
+    if (session->connect_deadline_ns == 0) {
+        debug("Starting session %d, waiting for client pipes...\n", session->id);
+        session->connect_deadline_ns = monotonic_ns() + (uint64_t)CONNECT_TIMEOUT_MS * 1000000;
+    }
+
+    session->notif_fd = open(session->notif_pipe_path, O_WRONLY | O_NONBLOCK);
+    if (session->notif_fd == -1 && errno == ENXIO && monotonic_ns() < session->connect_deadline_ns) {
+        return 1; // no reader yet
+    }
     if(session->notif_fd == -1) {
          debug("Failed to open notif pipe %s\n", session->notif_pipe_path);
-         unregister_session(session);
-         free(session);
-         return NULL;
+         return -1;
     }
 
-    session->req_fd = open(session->req_pipe_path, O_RDONLY);
+    // a client that stops reading must never block the simulation
+    if (outqueue_init(&session->notif, session->notif_fd, NOTIF_QUEUE_LEN, DROP_POLICY) == -1) {
+        close(session->notif_fd);
+        return -1;
+    }
+
+    // the client opens its end right after the notification pipe. Until it
+    // does, epoll reports nothing: a FIFO only hangs up after a writer left.
+    session->req_fd = open(session->req_pipe_path, O_RDONLY | O_NONBLOCK);
     if(session->req_fd == -1) {
         debug("Failed to open req pipe %s\n", session->req_pipe_path);
+        outqueue_destroy(&session->notif);
         close(session->notif_fd);
-        unregister_session(session);
-        free(session);
-        return NULL;
+        return -1;
     }
 
     debug("Session %d connected.\n", session->id);
 
     session->client_connected = 1;
-    pthread_mutex_init(&session->cmd_mutex, NULL);
-    
-    run_game_session(session);
+    session->ring = NULL;
+    session->ring_gen = 0;
+    session->accumulated_points = 0;
+    session->next_level = 0;
+    memset(&session->input, 0, sizeof(session->input));
+    session->inputs_played = 0;
+    session->input_wait_ns = 0;
+    session->deadlines_missed = 0;
+    session->in_len = 0;
+    encoder_init(&session->encoder, KEYFRAME_INTERVAL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // wait_pacman_command deadlines
+    pthread_cond_init(&session->input_ready, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&session->session_mutex, NULL);
+    pthread_mutex_init(&session->send_lock, NULL);
+
+    if (io_loop_add(session->req_fd, session_input, session) == -1) {
+        debug("Failed to watch req pipe %s\n", session->req_pipe_path);
+        encoder_destroy(&session->encoder);
+        pthread_cond_destroy(&session->input_ready);
+        pthread_mutex_destroy(&session->session_mutex);
+        pthread_mutex_destroy(&session->send_lock);
+        outqueue_destroy(&session->notif);
+        close(session->req_fd);
+        close(session->notif_fd);
+        return -1;
+    }
 
+    session->seed = (BASE_SEED ? BASE_SEED : monotonic_ns()) ^ ((uint64_t)session->id << 32);
+    session->log_fd = -1;
+    if (TICK_ENGINE && REPLAY_DIR[0]) {
+        session->log_fd = replay_create(REPLAY_DIR, session->id, session->seed, LEVELS_DIR);
+        if (session->log_fd == -1) debug("Session %d can't create its input log in %s\n", session->id, REPLAY_DIR);
+    }
+    return 0;
+}
+
+// Tells the client and the spectators the game is over and releases everything the session holds
+static void session_finish(game_session_t *session) {
+    frame_t *game_over = frame_alloc(sizeof(msg_board_header_t));
+    if (game_over) {
+        msg_board_header_t head = {0};
+        head.op_code = OP_CODE_BOARD;
+        head.game_over = 1;
+        memcpy(game_over->data, &head, sizeof(head));
+    }
+    if (session->client_connected && game_over) {
+        if (outqueue_push(&session->notif, frame_ref(game_over)) == 0) {
+            outqueue_drain(&session->notif, GAME_OVER_DRAIN_MS);
+        }
+    }
+
+    session->client_connected = 0;
+    io_loop_remove(session->req_fd);
+
+    debug("Session %d dropped %lu frames\n", session->id, session->notif.dropped);
+    debug("Session %d missed %lu deadlines\n", session->id, (unsigned long) session->deadlines_missed);
+    debug("Session %d played %lu inputs after %lu us on average, %lu dropped, %lu skipped\n", session->id,
+        session->inputs_played, session->inputs_played ? (unsigned long)(session->input_wait_ns / session->inputs_played / 1000) : 0,
+        session->input.dropped, session->input.skipped);
+    outqueue_destroy(&session->notif);
+    encoder_destroy(&session->encoder);
+    shm_ring_destroy(session->ring, session->ring_name);
+    pthread_cond_destroy(&session->input_ready);
+    pthread_mutex_destroy(&session->session_mutex);
+    pthread_mutex_destroy(&session->send_lock);
     close(session->req_fd);
     close(session->notif_fd);
-    pthread_mutex_destroy(&session->cmd_mutex);
-    
+    if (session->log_fd != -1) close(session->log_fd);
+
     unregister_session(session);
-    
+    spectators_close(session, game_over); // slower spectators don't hold the session up
+    frame_release(game_over);
+
     debug("Session %d finished\n", session->id);
+    snapshot_destroy(&session->snapshot); // unregistered, the SIGUSR1 dump can't reach it anymore
     free(session);
+}
+
+// Copies the next cached level into the session. Returns 0 if there is none left.
+// Every level gets its own random stream from the session seed, so a level
+// replays the same way no matter how many random moves the previous ones drew.
+static int session_load_next_level(game_session_t *session) {
+    while (session->next_level < level_cache_count()) {
+        int level = session->next_level++;
+        if (level_cache_load(level, &session->board, session->accumulated_points) == 0) {
+            session->level = level;
+            seed_board(&session->board, session->seed, level);
+            if (snapshot_publish(&session->snapshot, &session->board) == -1) {
+                // reloaded larger than any level was when the session started
+                debug("Session %d skips level %d, too large for its snapshot\n", session->id, level);
+                unload_level(&session->board);
+                continue;
+            }
+            if (session->client_connected) {
+                // two keyframes, so a full frame never waits for the client to read the last one
+                size_t keyframe = sizeof(msg_board_header_t) + (size_t)session->board.width * session->board.height;
+                outqueue_reserve(&session->notif, 2 * keyframe);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Delay until the next tick, counted from the absolute deadline of the last one
+// so the time spent ticking and waiting for a worker doesn't add up into drift
+static int next_tick_delay(game_session_t *session) {
+    session->deadlines_missed += next_deadline(&session->tick_deadline_ns, session->board.tempo);
+    uint64_t now = monotonic_ns();
+    if (session->tick_deadline_ns <= now) return 0;
+    return (int)((session->tick_deadline_ns - now + 999999) / 1000000);
+}
+
+/*
+Advances a session by one step and returns the delay in ms until the next one,
+or -1 once the session is over and has been freed.
+In tick engine mode a playing step is a single tick, so the worker pool can
+interleave many sessions. Otherwise it runs a whole level with its own threads.
+*/
+int session_step(void *arg) {
+    game_session_t *session = (game_session_t*) arg;
+
+    switch (session->phase) {
+        case SESSION_CONNECTING: {
+            int connected = session_connect(session);
+            if (connected == 1) return CONNECT_RETRY_MS;
+            if (connected == -1) {
+                unregister_session(session);
+                spectators_close(session, NULL);
+                snapshot_destroy(&session->snapshot);
+                free(session);
+                return -1;
+            }
+            session->phase = SESSION_LOADING;
+            return 0;
+        }
+
+        case SESSION_LOADING:
+            if (!session->client_connected || !session_load_next_level(session)) {
+                session->phase = SESSION_FINISHED;
+                return 0;
+            }
+            tick_state_init(&session->ticks, &session->board);
+            session->phase = SESSION_PLAYING;
+            if (!TICK_ENGINE) return 0;
+            session->tick_deadline_ns = monotonic_ns() + (uint64_t)session->board.tempo * 1000000;
+            return session->board.tempo;
+
+        case SESSION_PLAYING: {
+            int result;
+            if (!TICK_ENGINE) result = run_level_threaded(session);
+            else if (!session->client_connected) result = QUIT_GAME;
+            else result = session_tick(session, &session->ticks);
+
+            if (result == CONTINUE_PLAY) return next_tick_delay(session);
+
+            if (session->log_fd != -1) {
+                replay_append(session->log_fd, REPLAY_LEVEL_END, session->level, session->ticks.tick, result, board_hash(&session->board));
+            }
+
+            if (result == NEXT_LEVEL) {
+                send_board(session);
+                session->phase = SESSION_LEVEL_DONE;
+                return session->board.tempo;
+            }
+
+            unload_level(&session->board);
+            session->phase = SESSION_FINISHED;
+            return 0;
+        }
+
+        case SESSION_LEVEL_DONE:
+            unload_level(&session->board);
+            session->phase = SESSION_LOADING;
+            return 0;
+
+        case SESSION_FINISHED:
+            session_finish(session);
+            return -1;
+    }
+    return -1;
+}
+
+// Runs a session to completion on its own thread
+void* game_worker(void* arg) {
+    int delay;
+    while ((delay = session_step(arg)) >= 0) {
+        if (delay > 0) sleep_ms(delay);
+    }
     return NULL;
 }
 
+// Registers a new session for a connect request and starts it
+static void start_session(msg_connect_t *msg) {
+    static int game_id_counter = 0;
+
+    pthread_mutex_lock(&registry.lock);
+    int slot_idx = -1;
+    for(int i=0; i<MAX_GAMES; i++) {
+        if (registry.sessions[i] == NULL) {
+            slot_idx = i;
+            break;
+        }
+    }
+    if (slot_idx == -1) {
+        // Should not happen if semaphore works correctly
+        pthread_mutex_unlock(&registry.lock);
+        sem_post(&available_slots);
+        return;
+    }
+
+    // zeroed, the SIGUSR1 dump may look at it before session_connect runs
+    game_session_t *session = calloc(1, sizeof(game_session_t));
+    if (!session || snapshot_init(&session->snapshot, level_cache_max_cells()) == -1) {
+        free(session);
+        pthread_mutex_unlock(&registry.lock);
+        sem_post(&available_slots);
+        return;
+    }
+    session->id = ++game_id_counter;
+    registry.sessions[slot_idx] = session;
+    pthread_mutex_unlock(&registry.lock);
+
+    pthread_mutex_init(&session->spectators_lock, NULL);
+    memset(session->req_pipe_path, 0, MAX_PIPE_PATH_LENGTH+1);
+    memset(session->notif_pipe_path, 0, MAX_PIPE_PATH_LENGTH+1);
+    strncpy(session->req_pipe_path, msg->req_pipe_path, MAX_PIPE_PATH_LENGTH);
+    strncpy(session->notif_pipe_path, msg->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+    session->use_shm = msg->op_code == OP_CODE_CONNECT_SHM;
+    session->phase = SESSION_CONNECTING;
+
+    if (TICK_ENGINE) {
+        scheduler_submit(session_step, session, 0);
+    }
+    else {
+        pthread_t tid;
+        pthread_create(&tid, NULL, game_worker, session);
+        pthread_detach(tid);
+    }
+}
+
+// Attaches the spectator of a spectate request to its game, or closes its pipe
+// right away if there is no such game
+static void start_spectator(msg_spectate_t *msg) {
+    char path[MAX_PIPE_PATH_LENGTH + 1] = {0};
+    strncpy(path, msg->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+
+    // the spectator opened the pipe for reading before asking, this never blocks
+    int fd = open(path, O_WRONLY | O_NONBLOCK);
+    if (fd == -1) {
+        debug("Failed to open spectator pipe %s\n", path);
+        return;
+    }
+    spectator_t *spectator = calloc(1, sizeof(spectator_t));
+    if (!spectator || outqueue_init(&spectator->notif, fd, NOTIF_QUEUE_LEN, DROP_POLICY) == -1) {
+        free(spectator);
+        close(fd);
+        return;
+    }
+    spectator->resync = 1;
+
+    game_session_t *session = NULL;
+    pthread_mutex_lock(&registry.lock);
+    for (int i = 0; i < MAX_GAMES; i++) {
+        game_session_t *s = registry.sessions[i];
+        if (!s) continue;
+        if (msg->game_id ? s->id == msg->game_id : !session || s->id < session->id) session = s;
+    }
+    // the session can't be freed while it is registered
+    if (session) {
+        pthread_mutex_lock(&session->spectators_lock);
+        spectator->next = session->joining;
+        session->joining = spectator;
+        pthread_mutex_unlock(&session->spectators_lock);
+        debug("Spectator joined session %d\n", session->id);
+    }
+    pthread_mutex_unlock(&registry.lock);
+
+    if (!session) {
+        debug("No game %d to spectate\n", msg->game_id);
+        spectator_close(spectator);
+    }
+}
+
+// Connect requests in arrival order, see accept_connections
+static struct {
+    msg_connect_t requests[MAX_WAITING_CONNECTS];
+    int head;
+    int count;
+} waiting;
+
+// Reads size bytes of a request. Requests are smaller than PIPE_BUF, so the
+// rest of one is always there. Returns -1 if it isn't.
+static int read_request(int fd, void *buf, size_t size) {
+    ssize_t n;
+    while ((n = read(fd, buf, size)) == -1 && errno == EINTR);
+    return n == (ssize_t) size ? 0 : -1;
+}
+
+// Throws away everything in the register FIFO. After a request that isn't one,
+// where the next request starts is lost, and the clients that wrote what was
+// dropped never get their pipes opened.
+static void resync_requests(int fd) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n == -1 && errno == EINTR));
+    debug("Malformed request on the register FIFO, dropped what was queued\n");
+}
+
+// I/O thread handler for the register FIFO. Spectate requests are served as
+// they are read. Connect requests wait in arrival order for a free slot, while
+// the FIFO keeps being read for spectators; only once MAX_WAITING_CONNECTS
+// wait it is left alone until slot_released.
+static void accept_connections(int fd, void *arg) {
+    (void) arg;
+
+    while (true) {
+        while (waiting.count > 0 && sem_trywait(&available_slots) == 0) {
+            debug("Received connect request\n");
+            start_session(&waiting.requests[waiting.head]);
+            waiting.head = (waiting.head + 1) % MAX_WAITING_CONNECTS;
+            waiting.count--;
+        }
+        if (waiting.count == MAX_WAITING_CONNECTS) return;
+
+        int op_code;
+        ssize_t n = read(fd, &op_code, sizeof(op_code));
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return; // drained
+        if (n != sizeof(op_code)) {
+            resync_requests(fd);
+            return;
+        }
+
+        int ok = 0;
+        if (op_code == OP_CODE_SPECTATE) {
+            msg_spectate_t msg = { .op_code = op_code };
+            ok = read_request(fd, (char*) &msg + sizeof(op_code), sizeof(msg) - sizeof(op_code)) == 0;
+            if (ok) start_spectator(&msg);
+        }
+        else if (op_code == OP_CODE_CONNECT || op_code == OP_CODE_CONNECT_SHM) {
+            msg_connect_t *msg = &waiting.requests[(waiting.head + waiting.count) % MAX_WAITING_CONNECTS];
+            msg->op_code = op_code;
+            ok = read_request(fd, (char*) msg + sizeof(op_code), sizeof(*msg) - sizeof(op_code)) == 0;
+            if (ok) waiting.count++;
+        }
+        if (!ok) {
+            resync_requests(fd);
+            return;
+        }
+    }
+}
+
+// I/O thread handler for slot_released_fd
+static void slot_released(int fd, void *arg) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) > 0);
+    accept_connections(*(int*) arg, NULL);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Loads the next level of a headless session, going back to the first one
+// after the last level or a game over so the workload never runs out
+static int headless_load(game_session_t *session) {
+    for (int tries = 0; tries < 2; tries++) {
+        if (session_load_next_level(session)) {
+            tick_state_init(&session->ticks, &session->board);
+            return 0;
+        }
+        session->next_level = 0;
+    }
+    return -1;
+}
+
+/*
+Runs n_sessions sessions for HEADLESS_TICKS ticks each on a virtual clock:
+no clients, no frames and no sleeps, every tick runs as soon as the last one
+is done. Prints throughput and per tick latency, in a key=value per line format.
+*/
+static int run_headless(int n_sessions) {
+    int ret = 1;
+    int loaded = 0; // sessions[0..loaded) hold a level, but for failed
+    int failed = -1;
+    game_session_t *sessions = calloc(n_sessions, sizeof(game_session_t));
+    size_t n_samples = (size_t)HEADLESS_TICKS * n_sessions;
+    uint64_t *latency = malloc(n_samples * sizeof(uint64_t));
+    if (!sessions || !latency) {
+        perror("headless");
+        goto cleanup;
+    }
+
+    for (; loaded < n_sessions; loaded++) {
+        sessions[loaded].id = loaded + 1;
+        sessions[loaded].seed = loaded + 1; // same random moves on every run
+        sessions[loaded].log_fd = -1;
+        if (snapshot_init(&sessions[loaded].snapshot, level_cache_max_cells()) == -1) {
+            perror("headless");
+            goto cleanup;
+        }
+        if (headless_load(&sessions[loaded]) == -1) {
+            fprintf(stderr, "No playable levels in %s\n", LEVELS_DIR);
+            goto cleanup;
+        }
+    }
+
+    unsigned long moves = 0, levels = 1;
+    uint64_t virtual_ms = 0;
+    size_t n = 0;
+    uint64_t start = monotonic_ns();
+    for (long t = 0; t < HEADLESS_TICKS; t++) {
+        for (int i = 0; i < n_sessions; i++) {
+            game_session_t *session = &sessions[i];
+
+            uint64_t before = monotonic_ns();
+            int result = session_tick(session, &session->ticks);
+            latency[n++] = monotonic_ns() - before;
+
+            if (i == 0) virtual_ms += session->board.tempo;
+            if (result == CONTINUE_PLAY) continue;
+
+            moves += session->ticks.moves;
+            unload_level(&session->board);
+            if (result == QUIT_GAME) session->next_level = 0;
+            if (headless_load(session) == -1) {
+                fprintf(stderr, "No playable levels in %s\n", LEVELS_DIR);
+                failed = i;
+                goto cleanup;
+            }
+            levels++;
+        }
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    for (int i = 0; i < n_sessions; i++) {
+        moves += sessions[i].ticks.moves;
+    }
+
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    printf("sessions=%d\n", n_sessions);
+    printf("ticks=%zu\n", n);
+    printf("levels=%lu\n", levels);
+    printf("moves=%lu\n", moves);
+    printf("elapsed_s=%.3f\n", elapsed);
+    printf("virtual_s=%.3f\n", virtual_ms / 1e3);
+    printf("ticks_per_s=%.0f\n", n / elapsed);
+    printf("moves_per_s=%.0f\n", moves / elapsed);
+    printf("tick_p50_ns=%lu\n", (unsigned long) latency[n / 2]);
+    printf("tick_p90_ns=%lu\n", (unsigned long) latency[n * 9 / 10]);
+    printf("tick_p99_ns=%lu\n", (unsigned long) latency[n * 99 / 100]);
+    printf("tick_max_ns=%lu\n", (unsigned long) latency[n - 1]);
+    ret = 0;
+
+cleanup:
+    for (int i = 0; sessions && i < n_sessions; i++) {
+        if (i < loaded && i != failed) unload_level(&sessions[i].board);
+        snapshot_destroy(&sessions[i].snapshot);
+    }
+    free(latency);
+    free(sessions);
+    return ret;
+}
+
+/*
+Re-simulates a session from its input log at full speed and checks the board
+hash at the end of every level against the one the server logged.
+Returns 0 if the replay took exactly the same path.
+*/
+static int run_replay(char *path) {
+    replay_header_t header;
+    replay_record_t *records;
+    size_t n_records;
+    if (replay_load(path, &header, &records, &n_records) == -1) {
+        perror("replay log");
+        return 1;
+    }
+
+    if (!LEVELS_DIR[0]) strncpy(LEVELS_DIR, header.levels, 255);
+    open_debug_file("server.log");
+    if (level_cache_init(LEVELS_DIR) == -1) {
+        perror("levels dir");
+        return 1;
+    }
+
+    game_session_t *session = calloc(1, sizeof(game_session_t));
+    if (!session || snapshot_init(&session->snapshot, level_cache_max_cells()) == -1) {
+        perror("replay");
+        free(session);
+        free(records);
+        return 1;
+    }
+    session->seed = header.seed;
+    session->log_fd = -1;
+
+    int playing = session_load_next_level(session);
+    if (playing) tick_state_init(&session->ticks, &session->board);
+
+    int mismatches = 0;
+    unsigned long ticks = 0;
+    uint64_t start = monotonic_ns();
+    for (size_t r = 0; r < n_records && playing; r++) {
+        replay_record_t *record = &records[r];
+        if (record->level != session->level) {
+            printf("record %zu is for level %d, replay is on level %d\n", r, record->level, session->level);
+            mismatches++;
+            break;
+        }
+
+        // an input is consumed on its tick, so stop right before it
+        unsigned long until = record->kind == REPLAY_INPUT ? record->tick - 1 : record->tick;
+        int result = CONTINUE_PLAY;
+        while (session->ticks.tick < until && result == CONTINUE_PLAY) {
+            result = session_tick(session, &session->ticks);
+            ticks++;
+        }
+
+        if (record->kind == REPLAY_INPUT) {
+            if (result != CONTINUE_PLAY) {
+                printf("level %d ended on tick %lu, the log goes on to tick %u\n", session->level, session->ticks.tick, record->tick);
+                mismatches++;
+                break;
+            }
+            cmd_ring_push(&session->input, record->command, monotonic_ns());
+            continue;
+        }
+
+        // a quit with the level still going is the client disconnecting
+        int same_end = session->ticks.tick == record->tick &&
+            (result == record->command || (record->command == QUIT_GAME && result == CONTINUE_PLAY));
+        uint64_t hash = board_hash(&session->board);
+        int ok = same_end && hash == record->value;
+        printf("level=%d tick=%lu result=%d hash=%016llx %s\n", session->level, session->ticks.tick, result,
+            (unsigned long long) hash, ok ? "ok" : "MISMATCH");
+        if (!ok) mismatches++;
+
+        unload_level(&session->board);
+        playing = record->command == NEXT_LEVEL && session_load_next_level(session);
+        if (playing) tick_state_init(&session->ticks, &session->board);
+    }
+    double elapsed = (monotonic_ns() - start) / 1e9;
+
+    if (playing) {
+        printf("log ends in the middle of level %d, the server stopped before the session did\n", session->level);
+        unload_level(&session->board);
+    }
+    printf("records=%zu\n", n_records);
+    printf("ticks=%lu\n", ticks);
+    printf("elapsed_s=%.3f\n", elapsed);
+    printf("ticks_per_s=%.0f\n", elapsed > 0 ? ticks / elapsed : 0);
+    printf("mismatches=%d\n", mismatches);
+
+    snapshot_destroy(&session->snapshot);
+    free(session);
+    free(records);
+    return mismatches ? 1 : 0;
+}
+
+static void usage(char *prog) {
+    printf("Usage: %s [-t] [-w workers] [-q frames] [-d oldest|newest] [-k frames] [-S seed] [-i latest|all|ahead] [-L] [-l log_dir] <levels_dir|bundle> <max_games> <fifo_name>\n", prog);
+    printf("       %s -s ticks <levels_dir|bundle> [sessions]\n", prog);
+    printf("       %s -r log [levels_dir|bundle]\n", prog);
+    printf("  -t  run sessions as tick engine tasks on a shared worker pool\n");
+    printf("  -w  number of pool workers (default: one per core)\n");
+    printf("  -q  frames buffered per client before dropping (default: %d)\n", NOTIF_QUEUE_LEN);
+    printf("  -d  frame dropped by a full client queue: oldest (default) or newest\n");
+    printf("  -k  frames between full boards, deltas in between (default: %d, 1 disables deltas)\n", KEYFRAME_INTERVAL);
+    printf("  -s  headless benchmark: run each session for this many ticks on a virtual clock and report\n");
+    printf("  -S  seed for the sessions' random moves (default: from the clock)\n");
+    printf("  -i  commands a pacman turn plays: latest (default) drops older keys, all plays them in order,\n");
+    printf("      ahead plays them in order but keeps only the newest of those still waiting\n");
+    printf("  -L  low latency: play a key as soon as pacman's turn is due and send its frame right away\n");
+    printf("      (threaded engine; the tick engine already sends the frame of the tick that plays a key)\n");
+    printf("  -l  with -t, write every session's input log to this directory\n");
+    printf("  -r  replay a session from its input log and check it plays out the same\n");
+}
+
 int main(int argc, char** argv) {
-    if (argc != 4) {
-        printf("Usage: %s <levels_dir> <max_games> <fifo_name>\n", argv[0]);
+    int opt;
+    char *replay_log = NULL;
+    while ((opt = getopt(argc, argv, "tw:q:d:k:s:l:r:S:i:L")) != -1) {
+        switch (opt) {
+            case 't':
+                TICK_ENGINE = 1;
+                break;
+            case 'w':
+                N_WORKERS = atoi(optarg);
+                break;
+            case 'q':
+                NOTIF_QUEUE_LEN = atoi(optarg);
+                break;
+            case 'd':
+                if (parse_drop_policy(optarg) == -1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                DROP_POLICY = parse_drop_policy(optarg);
+                break;
+            case 'k':
+                KEYFRAME_INTERVAL = atoi(optarg);
+                break;
+            case 's':
+                HEADLESS_TICKS = atol(optarg);
+                break;
+            case 'S':
+                BASE_SEED = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                if (parse_input_mode(optarg) == -1) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                INPUT_MODE = parse_input_mode(optarg);
+                break;
+            case 'L':
+                LOW_LATENCY = 1;
+                break;
+            case 'l':
+                strncpy(REPLAY_DIR, optarg, 255);
+                break;
+            case 'r':
+                replay_log = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+
+    if (replay_log) {
+        if (argc - optind > 1) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (argc - optind == 1) strncpy(LEVELS_DIR, argv[optind], 255);
+        return run_replay(replay_log);
+    }
+
+    if (HEADLESS_TICKS > 0) {
+        if (argc - optind < 1 || argc - optind > 2) {
+            usage(argv[0]);
+            return -1;
+        }
+        strncpy(LEVELS_DIR, argv[optind], 255);
+        int n_sessions = argc - optind == 2 ? atoi(argv[optind + 1]) : 1;
+
+        open_debug_file("server.log");
+        if (level_cache_init(LEVELS_DIR) == -1) {
+            perror("levels dir");
+            return 1;
+        }
+        return run_headless(n_sessions > 0 ? n_sessions : 1);
+    }
+
+    if (argc - optind != 3) {
+        usage(argv[0]);
         return -1;
     }
 
-    strncpy(LEVELS_DIR, argv[1], 255);
-    MAX_GAMES = atoi(argv[2]);
-    strncpy(REGISTER_FIFO, argv[3], 255);
+    strncpy(LEVELS_DIR, argv[optind], 255);
+    MAX_GAMES = atoi(argv[optind + 1]);
+    strncpy(REGISTER_FIFO, argv[optind + 2], 255);
 
     registry.sessions = calloc(MAX_GAMES, sizeof(void*));
     pthread_mutex_init(&registry.lock, NULL);
     signal(SIGUSR1, signal_handler);
+    signal(SIGPIPE, SIG_IGN); // a vanished client shows up as EPIPE instead
 
     if (mkfifo(REGISTER_FIFO, 0666) == -1) {
         if (errno != EEXIST) {
@@ -428,63 +1389,38 @@ int main(int argc, char** argv) {
     
     sem_init(&available_slots, 0, MAX_GAMES);
     open_debug_file("server.log");
+
+    if (level_cache_init(LEVELS_DIR) == -1) {
+        perror("levels dir");
+        return 1;
+    }
+
+    if (TICK_ENGINE && scheduler_start(N_WORKERS) != 0) {
+        perror("scheduler_start");
+        return 1;
+    }
     
     printf("Server started! Listening on %s with %d slots...\n", REGISTER_FIFO, MAX_GAMES);
     debug("Server started on %s with %d slots\n", REGISTER_FIFO, MAX_GAMES);
 
-    int server_fd = open(REGISTER_FIFO, O_RDWR); // O_RDWR blocks EOF
+    int server_fd = open(REGISTER_FIFO, O_RDWR | O_NONBLOCK); // O_RDWR blocks EOF
     if (server_fd == -1) {
         perror("open register fifo");
         return 1;
     }
 
-    int game_id_counter = 0;
-
-    while(1) {
-        msg_connect_t msg; 
-        ssize_t n = read(server_fd, &msg, sizeof(msg));
-        if (n == sizeof(msg) && msg.op_code == OP_CODE_CONNECT) {
-            
-            debug("Received connect request\n");
-            
-            // Block if full, retry on interrupt (e.g. signal)
-            while (sem_wait(&available_slots) == -1) {
-                if (errno != EINTR) { 
-                    perror("sem_wait failed");
-                    break;
-                }
-            }
-            
-            pthread_mutex_lock(&registry.lock);
-            int slot_idx = -1;
-            for(int i=0; i<MAX_GAMES; i++) {
-                if (registry.sessions[i] == NULL) {
-                    slot_idx = i;
-                    break;
-                }
-            }
-            if (slot_idx == -1) {
-                // Should not happen if semaphore works correctly
-                pthread_mutex_unlock(&registry.lock);
-                sem_post(&available_slots);
-                continue;
-            }
-
-            game_session_t *session = malloc(sizeof(game_session_t));
-            registry.sessions[slot_idx] = session;
-            pthread_mutex_unlock(&registry.lock);
-
-            session->id = ++game_id_counter;
-            memset(session->req_pipe_path, 0, MAX_PIPE_PATH_LENGTH+1);
-            memset(session->notif_pipe_path, 0, MAX_PIPE_PATH_LENGTH+1);
-            strncpy(session->req_pipe_path, msg.req_pipe_path, MAX_PIPE_PATH_LENGTH);
-            strncpy(session->notif_pipe_path, msg.notif_pipe_path, MAX_PIPE_PATH_LENGTH);
-            
-            pthread_t tid;
-            pthread_create(&tid, NULL, game_worker, session);
-            pthread_detach(tid); 
-        }
+    slot_released_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io_loop_init() == -1 || slot_released_fd == -1) {
+        perror("io loop");
+        return 1;
     }
+    io_loop_add(server_fd, accept_connections, NULL);
+    io_loop_add(slot_released_fd, slot_released, &server_fd);
+    if (level_cache_watch_fd() != -1) {
+        io_loop_add(level_cache_watch_fd(), level_cache_changed, NULL);
+    }
+
+    io_loop_run();
 
     close(server_fd);
     unlink(REGISTER_FIFO);
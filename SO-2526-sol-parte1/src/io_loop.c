@@ -0,0 +1,88 @@
+#include "io_loop.h"
+#include "board.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 64
+
+typedef struct {
+    io_handler_t handler;
+    void *arg;
+} io_watch_t;
+
+// Watches are indexed by fd. Handlers run with the lock held, so removing a
+// watch waits for a running handler and stale events find no handler.
+static struct {
+    int epfd;
+    io_watch_t *watches;
+    int n_watches;
+    pthread_mutex_t lock;
+} loop;
+
+int io_loop_init() {
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd == -1) return -1;
+    pthread_mutex_init(&loop.lock, NULL);
+    return 0;
+}
+
+int io_loop_add(int fd, io_handler_t handler, void *arg) {
+    pthread_mutex_lock(&loop.lock);
+    if (fd >= loop.n_watches) {
+        int n = fd + 1 > loop.n_watches * 2 ? fd + 1 : loop.n_watches * 2;
+        io_watch_t *watches = realloc(loop.watches, n * sizeof(io_watch_t));
+        if (!watches) {
+            pthread_mutex_unlock(&loop.lock);
+            return -1;
+        }
+        memset(watches + loop.n_watches, 0, (n - loop.n_watches) * sizeof(io_watch_t));
+        loop.watches = watches;
+        loop.n_watches = n;
+    }
+    loop.watches[fd].handler = handler;
+    loop.watches[fd].arg = arg;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.fd = fd };
+    int ret = epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (ret == -1) {
+        loop.watches[fd].handler = NULL;
+    }
+    pthread_mutex_unlock(&loop.lock);
+    return ret;
+}
+
+void io_loop_remove(int fd) {
+    pthread_mutex_lock(&loop.lock);
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, NULL);
+    if (fd < loop.n_watches) {
+        loop.watches[fd].handler = NULL;
+        loop.watches[fd].arg = NULL;
+    }
+    pthread_mutex_unlock(&loop.lock);
+}
+
+void io_loop_run() {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(loop.epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            debug("epoll_wait failed\n");
+            return;
+        }
+
+        pthread_mutex_lock(&loop.lock);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd < loop.n_watches && loop.watches[fd].handler) {
+                loop.watches[fd].handler(fd, loop.watches[fd].arg);
+            }
+        }
+        pthread_mutex_unlock(&loop.lock);
+    }
+}
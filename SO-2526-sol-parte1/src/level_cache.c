@@ -0,0 +1,471 @@
+#include "level_cache.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+
+/*
+Level bundle, written by levelc and mapped read-only by the server:
+a bundle_header_t, one bundle_level_t per level, then for every level its
+plane block (laid out exactly like alloc_board_cells) followed by its
+pacman_t and ghost_t tables, each section aligned to BUNDLE_ALIGN.
+The tables are the raw structs, so a bundle only loads into a server built
+with the same struct sizes.
+*/
+#define BUNDLE_MAGIC "PACLVLS"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_levels;
+    uint32_t pacman_size; // sizeof(pacman_t) when the bundle was compiled
+    uint32_t ghost_size; // sizeof(ghost_t) when the bundle was compiled
+} bundle_header_t;
+
+typedef struct {
+    char name[MAX_FILENAME]; // .lvl file it was compiled from
+    int32_t width, height;
+    int32_t tempo;
+    int32_t n_pacmans, n_ghosts;
+    uint64_t cells; // offset of the plane block
+    uint64_t entities; // offset of pacman_t[n_pacmans] followed by ghost_t[n_ghosts]
+} bundle_level_t;
+
+typedef struct {
+    char name[MAX_FILENAME]; // file name inside the levels directory
+    board_t *level; // NULL once the file is gone or stops parsing
+} cached_level_t;
+
+// Sessions only read the templates, under the read lock, while they copy one.
+// The reload thread is the only writer: it parses outside the lock and swaps the pointer.
+static struct {
+    char dir[MAX_FILENAME];
+    cached_level_t *levels;
+    int count;
+    int capacity;
+    size_t max_cells; // of the largest level ever cached, only grows
+    int watch_fd;
+    void *bundle; // mapped bundle the templates point into, NULL when loaded from a directory
+    size_t bundle_size;
+    pthread_rwlock_t lock;
+} cache = { .watch_fd = -1 };
+
+// File that changed, waiting for the reload thread
+typedef struct change {
+    char name[MAX_FILENAME];
+    struct change *next;
+} change_t;
+
+// The I/O thread only queues what changed, parsing happens on the reload thread
+// so a slow reload never holds up the clients' input
+static struct {
+    change_t *head;
+    int reload_all; // inotify lost events, every level is parsed again
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} changes = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int is_level_file(const char *name) {
+    if (name[0] == '.') return 0;
+    char *dot = strrchr(name, '.');
+    return dot && strcmp(dot, ".lvl") == 0;
+}
+
+static board_t* parse_level(char *name) {
+    board_t *level = calloc(1, sizeof(board_t));
+    if (!level) return NULL;
+
+    if (load_level(level, name, cache.dir, 0) == -1) {
+        free(level->walls);
+        free(level->pacmans);
+        free(level->ghosts);
+        free(level);
+        return NULL;
+    }
+    return level;
+}
+
+static void free_level(board_t *level) {
+    if (!level) return;
+    unload_level(level);
+    free(level);
+}
+
+// Expects the write lock to be held
+static void track_size(const board_t *level) {
+    size_t cells = (size_t)level->width * level->height;
+    if (cells > cache.max_cells) cache.max_cells = cells;
+}
+
+// Appends a new level index, expects the write lock to be held
+static int append_level(char *name, board_t *level) {
+    if (level) track_size(level);
+    if (cache.count == cache.capacity) {
+        int capacity = cache.capacity ? cache.capacity * 2 : MAX_LEVELS;
+        cached_level_t *levels = realloc(cache.levels, capacity * sizeof(cached_level_t));
+        if (!levels) return -1;
+        cache.levels = levels;
+        cache.capacity = capacity;
+    }
+    snprintf(cache.levels[cache.count].name, MAX_FILENAME, "%s", name);
+    cache.levels[cache.count].level = level;
+    cache.count++;
+    return 0;
+}
+
+// Parses name again and swaps the new template in, or adds it as the last level
+static void reload_level(char *name) {
+    board_t *level = parse_level(name);
+    board_t *old = NULL;
+
+    pthread_rwlock_wrlock(&cache.lock);
+    int i;
+    for (i = 0; i < cache.count; i++) {
+        if (strcmp(cache.levels[i].name, name) == 0) break;
+    }
+    if (i < cache.count) {
+        old = cache.levels[i].level;
+        cache.levels[i].level = level;
+        if (level) track_size(level);
+    }
+    else if (!level || append_level(name, level) == -1) {
+        old = level;
+    }
+    pthread_rwlock_unlock(&cache.lock);
+
+    // nobody can be copying it anymore, copies only happen under the read lock
+    free_level(old);
+    debug("Level %s %s\n", name, level ? "reloaded" : "removed");
+}
+
+// Whether a cached level reads its pacman or one of its ghosts from the file name
+static int uses_file(const board_t *level, const char *name) {
+    if (!level) return 0;
+    const char *base = strrchr(level->pacman_file, '/');
+    if (level->pacman_file[0] && strcmp(base ? base + 1 : level->pacman_file, name) == 0) return 1;
+    for (int g = 0; g < level->n_ghosts; g++) {
+        base = strrchr(level->ghosts_files[g], '/');
+        if (strcmp(base ? base + 1 : level->ghosts_files[g], name) == 0) return 1;
+    }
+    return 0;
+}
+
+// A movement file changed, every level built from it has to be parsed again
+static void reload_users_of(const char *name) {
+    // only this thread adds levels, so count and names are stable while it runs
+    for (int i = 0; i < cache.count; i++) {
+        pthread_rwlock_rdlock(&cache.lock);
+        int uses = uses_file(cache.levels[i].level, name);
+        pthread_rwlock_unlock(&cache.lock);
+        if (uses) reload_level(cache.levels[i].name);
+    }
+}
+
+// Applies the queued changes as they come, a file changed several times before
+// the thread got to it is parsed once
+static void* reload_thread(void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&changes.lock);
+        while (!changes.head && !changes.reload_all) {
+            pthread_cond_wait(&changes.cond, &changes.lock);
+        }
+        change_t *change = changes.head;
+        int reload_all = changes.reload_all;
+        changes.head = NULL;
+        changes.reload_all = 0;
+        pthread_mutex_unlock(&changes.lock);
+
+        if (reload_all) {
+            for (int i = 0; i < cache.count; i++) reload_level(cache.levels[i].name);
+        }
+        while (change) {
+            change_t *next = change->next;
+            if (!reload_all) {
+                if (is_level_file(change->name)) reload_level(change->name);
+                else reload_users_of(change->name);
+            }
+            free(change);
+            change = next;
+        }
+    }
+    return NULL;
+}
+
+// Queues name for the reload thread unless it is already waiting. Expects changes.lock.
+static void queue_change(const char *name) {
+    change_t **link = &changes.head;
+    for (; *link; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) return;
+    }
+    change_t *change = calloc(1, sizeof(change_t));
+    if (!change) {
+        changes.reload_all = 1;
+        return;
+    }
+    snprintf(change->name, sizeof(change->name), "%s", name);
+    *link = change;
+}
+
+static size_t align_up(size_t n) {
+    return (n + BUNDLE_ALIGN - 1) & ~(size_t)(BUNDLE_ALIGN - 1);
+}
+
+static size_t entities_size(const board_t *level) {
+    return level->n_pacmans * sizeof(pacman_t) + level->n_ghosts * sizeof(ghost_t);
+}
+
+// Maps a bundle and builds templates whose planes and tables point straight into it
+static int map_bundle(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(bundle_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const char *base = map;
+    size_t size = st.st_size;
+    const bundle_header_t *header = map;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BUNDLE_VERSION ||
+        header->pacman_size != sizeof(pacman_t) || header->ghost_size != sizeof(ghost_t) ||
+        sizeof(bundle_header_t) + (size_t)header->n_levels * sizeof(bundle_level_t) > size) {
+        debug("%s is not a level bundle for this server\n", path);
+        munmap(map, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    cache.bundle = map;
+    cache.bundle_size = size;
+
+    const bundle_level_t *entries = (const bundle_level_t*)(base + sizeof(bundle_header_t));
+    for (uint32_t i = 0; i < header->n_levels; i++) {
+        const bundle_level_t *entry = &entries[i];
+        char name[MAX_FILENAME];
+        snprintf(name, sizeof(name), "%.*s", MAX_FILENAME - 1, entry->name);
+
+        board_t *level = calloc(1, sizeof(board_t));
+        if (!level) break;
+
+        level->width = entry->width;
+        level->height = entry->height;
+        level->tempo = entry->tempo;
+        level->n_pacmans = entry->n_pacmans;
+        level->n_ghosts = entry->n_ghosts;
+        snprintf(level->level_name, sizeof(level->level_name), "%.*s", (int)strcspn(name, "."), name);
+
+        if (level->width <= 0 || level->height <= 0 || level->n_pacmans != 1 ||
+            level->n_ghosts < 0 || level->n_ghosts > MAX_GHOSTS ||
+            entry->cells % BUNDLE_ALIGN || entry->entities % BUNDLE_ALIGN ||
+            entry->cells + board_cells_size(level) > size || entry->entities + entities_size(level) > size) {
+            debug("Corrupted level %d in bundle %s\n", i, path);
+            free(level);
+            append_level(name, NULL);
+            continue;
+        }
+
+        // the templates are never written, the mapping is read-only anyway
+        attach_board_cells(level, (uint64_t*)(base + entry->cells));
+        level->pacmans = (pacman_t*)(base + entry->entities);
+        level->ghosts = (ghost_t*)(base + entry->entities + level->n_pacmans * sizeof(pacman_t));
+        append_level(name, level);
+    }
+
+    debug("Mapped %d levels from bundle %s\n", cache.count, path);
+    return cache.count;
+}
+
+int level_cache_init(char *dirname) {
+    snprintf(cache.dir, sizeof(cache.dir), "%s", dirname);
+    pthread_rwlock_init(&cache.lock, NULL);
+
+    struct stat st;
+    if (stat(dirname, &st) == 0 && S_ISREG(st.st_mode)) {
+        return map_bundle(dirname);
+    }
+
+    DIR *dir = opendir(dirname);
+    if (!dir) return -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_level_file(entry->d_name)) continue;
+
+        board_t *level = parse_level(entry->d_name);
+        if (!level) {
+            debug("Failed to load level %s\n", entry->d_name);
+            continue;
+        }
+        append_level(entry->d_name, level);
+    }
+    closedir(dir);
+
+    cache.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache.watch_fd != -1 && (inotify_add_watch(cache.watch_fd, dirname, WATCH_EVENTS) == -1 ||
+        pthread_create(&changes.tid, NULL, reload_thread, NULL) != 0)) {
+        close(cache.watch_fd);
+        cache.watch_fd = -1;
+    }
+    if (cache.watch_fd != -1) pthread_detach(changes.tid);
+    if (cache.watch_fd == -1) debug("Not watching %s for changes\n", dirname);
+
+    debug("Cached %d levels from %s\n", cache.count, dirname);
+    return cache.count;
+}
+
+int level_cache_count() {
+    pthread_rwlock_rdlock(&cache.lock);
+    int count = cache.count;
+    pthread_rwlock_unlock(&cache.lock);
+    return count;
+}
+
+size_t level_cache_max_cells() {
+    pthread_rwlock_rdlock(&cache.lock);
+    size_t cells = cache.max_cells;
+    pthread_rwlock_unlock(&cache.lock);
+    return cells;
+}
+
+int level_cache_load(int index, board_t *board, int accumulated_points) {
+    int result = -1;
+    pthread_rwlock_rdlock(&cache.lock);
+    if (index < cache.count && cache.levels[index].level) {
+        result = clone_level(board, cache.levels[index].level, accumulated_points);
+    }
+    pthread_rwlock_unlock(&cache.lock);
+    return result;
+}
+
+int level_cache_watch_fd() {
+    return cache.watch_fd;
+}
+
+void level_cache_changed(int fd, void *arg) {
+    (void) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t n;
+    pthread_mutex_lock(&changes.lock);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            struct inotify_event *event = (struct inotify_event*) p;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                // lost track of what changed, parse everything again
+                changes.reload_all = 1;
+                continue;
+            }
+            if (event->len == 0) continue;
+            queue_change(event->name);
+        }
+    }
+    if (changes.head || changes.reload_all) pthread_cond_signal(&changes.cond);
+    pthread_mutex_unlock(&changes.lock);
+}
+
+int level_cache_write_bundle(char *path) {
+    pthread_rwlock_rdlock(&cache.lock);
+
+    int n_levels = 0;
+    size_t size = sizeof(bundle_header_t);
+    for (int i = 0; i < cache.count; i++) {
+        if (cache.levels[i].level) n_levels++;
+    }
+    size = align_up(size + n_levels * sizeof(bundle_level_t));
+    for (int i = 0; i < cache.count; i++) {
+        board_t *level = cache.levels[i].level;
+        if (!level) continue;
+        size = align_up(size + board_cells_size(level));
+        size = align_up(size + entities_size(level));
+    }
+
+    char *buf = calloc(1, size);
+    if (!buf) {
+        pthread_rwlock_unlock(&cache.lock);
+        return -1;
+    }
+
+    bundle_header_t *header = (bundle_header_t*) buf;
+    memcpy(header->magic, BUNDLE_MAGIC, sizeof(header->magic));
+    header->version = BUNDLE_VERSION;
+    header->n_levels = n_levels;
+    header->pacman_size = sizeof(pacman_t);
+    header->ghost_size = sizeof(ghost_t);
+
+    bundle_level_t *entry = (bundle_level_t*)(buf + sizeof(bundle_header_t));
+    size_t offset = align_up(sizeof(bundle_header_t) + n_levels * sizeof(bundle_level_t));
+    for (int i = 0; i < cache.count; i++) {
+        board_t *level = cache.levels[i].level;
+        if (!level) continue;
+
+        snprintf(entry->name, sizeof(entry->name), "%s", cache.levels[i].name);
+        entry->width = level->width;
+        entry->height = level->height;
+        entry->tempo = level->tempo;
+        entry->n_pacmans = level->n_pacmans;
+        entry->n_ghosts = level->n_ghosts;
+
+        entry->cells = offset;
+        memcpy(buf + offset, level->walls, board_cells_size(level));
+        offset = align_up(offset + board_cells_size(level));
+
+        entry->entities = offset;
+        memcpy(buf + offset, level->pacmans, level->n_pacmans * sizeof(pacman_t));
+        memcpy(buf + offset + level->n_pacmans * sizeof(pacman_t), level->ghosts, level->n_ghosts * sizeof(ghost_t));
+        offset = align_up(offset + entities_size(level));
+        entry++;
+    }
+    pthread_rwlock_unlock(&cache.lock);
+
+    // written aside and renamed over, a server mapping the old bundle keeps its copy
+    char tmp[MAX_FILENAME + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        free(buf);
+        return -1;
+    }
+    for (size_t written = 0; written < size; ) {
+        ssize_t n = write(fd, buf + written, size - written);
+        if (n == -1) {
+            close(fd);
+            unlink(tmp);
+            free(buf);
+            return -1;
+        }
+        written += n;
+    }
+    free(buf);
+
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return n_levels;
+}
@@ -0,0 +1,28 @@
+#include "level_cache.h"
+#include <stdio.h>
+
+// Compiles a levels directory into a bundle the server can map instead of parsing
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        printf("Usage: %s <levels_dir> <bundle>\n", argv[0]);
+        return -1;
+    }
+
+    open_debug_file("levelc.log");
+
+    int n_levels = level_cache_init(argv[1]);
+    if (n_levels == -1) {
+        perror("levels dir");
+        return 1;
+    }
+
+    n_levels = level_cache_write_bundle(argv[2]);
+    if (n_levels == -1) {
+        perror("write bundle");
+        return 1;
+    }
+
+    printf("Compiled %d levels from %s into %s\n", n_levels, argv[1], argv[2]);
+    close_debug_file();
+    return 0;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include "outqueue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#define FLUSH_BATCH 16 // frames handed to a single writev
+
+frame_t* frame_alloc(size_t size) {
+    frame_t *frame = malloc(sizeof(frame_t) + size);
+    if (frame) {
+        frame->refs = 1;
+        frame->size = size;
+    }
+    return frame;
+}
+
+frame_t* frame_ref(frame_t* frame) {
+    frame->refs++;
+    return frame;
+}
+
+void frame_release(frame_t* frame) {
+    if (frame && --frame->refs == 0) free(frame);
+}
+
+int outqueue_init(outqueue_t* q, int fd, int capacity, drop_policy_t policy) {
+    if (capacity < 1) capacity = 1;
+    q->frames = calloc(capacity, sizeof(frame_t*));
+    if (!q->frames) return -1;
+    q->fd = fd;
+    q->head = 0;
+    q->count = 0;
+    q->capacity = capacity;
+    q->sent = 0;
+    q->policy = policy;
+    q->dropped = 0;
+    return 0;
+}
+
+void outqueue_destroy(outqueue_t* q) {
+    for (int i = 0; i < q->count; i++) {
+        frame_release(q->frames[(q->head + i) % q->capacity]);
+    }
+    free(q->frames);
+    q->frames = NULL;
+    q->count = 0;
+}
+
+// Removes the frame at position i (0 is the front) and closes the gap
+static void outqueue_remove(outqueue_t* q, int i) {
+    frame_release(q->frames[(q->head + i) % q->capacity]);
+    for (; i < q->count - 1; i++) {
+        q->frames[(q->head + i) % q->capacity] = q->frames[(q->head + i + 1) % q->capacity];
+    }
+    q->count--;
+}
+
+int outqueue_flush(outqueue_t* q) {
+    while (q->count > 0) {
+        // every queued frame in one syscall, the front one from where it was left
+        struct iovec iov[FLUSH_BATCH];
+        int n = 0;
+        for (; n < q->count && n < FLUSH_BATCH; n++) {
+            frame_t *frame = q->frames[(q->head + n) % q->capacity];
+            size_t skip = n == 0 ? q->sent : 0;
+            iov[n].iov_base = frame->data + skip;
+            iov[n].iov_len = frame->size - skip;
+        }
+
+        ssize_t w = writev(q->fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+
+        // a short write leaves the rest of a frame for the next flush
+        size_t left = w;
+        while (left > 0) {
+            frame_t *frame = q->frames[q->head];
+            size_t rest = frame->size - q->sent;
+            if (left < rest) {
+                q->sent += left;
+                break;
+            }
+            left -= rest;
+            frame_release(frame);
+            q->head = (q->head + 1) % q->capacity;
+            q->count--;
+            q->sent = 0;
+        }
+    }
+    return 0;
+}
+
+int outqueue_reserve(outqueue_t* q, size_t bytes) {
+    int size = fcntl(q->fd, F_GETPIPE_SZ);
+    if (size == -1 || (size_t)size >= bytes) return size;
+    if (bytes > INT_MAX) bytes = INT_MAX;
+
+    // above /proc/sys/fs/pipe-max-size only root may go, settle for what is allowed
+    for (size_t want = bytes; want > (size_t)size; want /= 2) {
+        int grown = fcntl(q->fd, F_SETPIPE_SZ, (int)want);
+        if (grown != -1) return grown;
+        if (errno != EPERM && errno != ENOMEM) break;
+    }
+    return size;
+}
+
+int outqueue_push(outqueue_t* q, frame_t* frame) {
+    if (q->count == q->capacity) {
+        // the front frame can only be dropped if none of it reached the client
+        int oldest = q->sent > 0 ? 1 : 0;
+        if (q->policy == DROP_NEWEST || oldest >= q->count) {
+            frame_release(frame);
+            q->dropped++;
+            return outqueue_flush(q);
+        }
+        outqueue_remove(q, oldest);
+        q->dropped++;
+    }
+
+    q->frames[(q->head + q->count) % q->capacity] = frame;
+    q->count++;
+    return outqueue_flush(q);
+}
+
+int outqueue_drain(outqueue_t* q, int timeout_ms) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (q->count > 0) {
+        if (outqueue_flush(q) == -1) return -1;
+        if (q->count == 0) break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= timeout_ms) return -1;
+
+        struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+        if (poll(&pfd, 1, timeout_ms - elapsed) == -1 && errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+int parse_drop_policy(const char* name) {
+    if (strcmp(name, "oldest") == 0) return DROP_OLDEST;
+    if (strcmp(name, "newest") == 0) return DROP_NEWEST;
+    return -1;
+}
@@ -5,21 +5,101 @@
 #include "parser.h"
 #include "board.h"
 #include <fcntl.h>
+#include <sys/stat.h>
+
+int open_lines(line_reader_t* reader, const char* path) {
+    reader->data = NULL;
+    reader->size = 0;
+    reader->pos = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // one extra byte so the last line can be terminated like every other one
+    reader->data = malloc(st.st_size + 1);
+    if (!reader->data) {
+        close(fd);
+        return -1;
+    }
+
+    while (reader->size < (size_t)st.st_size) {
+        ssize_t n = read(fd, reader->data + reader->size, st.st_size - reader->size);
+        if (n == -1) {
+            free(reader->data);
+            reader->data = NULL;
+            close(fd);
+            return -1;
+        }
+        if (n == 0) break; // truncated while reading
+        reader->size += n;
+    }
+    reader->data[reader->size] = '\0';
+
+    close(fd);
+    return 0;
+}
+
+void close_lines(line_reader_t* reader) {
+    free(reader->data);
+    reader->data = NULL;
+}
+
+char* read_line(line_reader_t* reader, size_t* len) {
+    if (reader->pos >= reader->size) return NULL;
+
+    char *line = reader->data + reader->pos;
+    char *end = memchr(line, '\n', reader->size - reader->pos);
+    if (!end) end = reader->data + reader->size;
+    reader->pos = end - reader->data + 1;
+
+    if (end > line && end[-1] == '\r') end--;
+    *end = '\0';
+    if (len) *len = end - line;
+    return line;
+}
+
+static char* skip_blanks(char* s) {
+    while (*s == ' ' || *s == '\t') s++;
+    return s;
+}
+
+// Splits the next blank separated word off *cursor, in place
+static char* next_word(char** cursor) {
+    char *word = skip_blanks(*cursor);
+    if (*word == '\0') return NULL;
+
+    char *end = word;
+    while (*end && *end != ' ' && *end != '\t') end++;
+    *cursor = *end ? end + 1 : end;
+    *end = '\0';
+    return word;
+}
+
+// Arguments after keyword if line starts with it, NULL otherwise.
+// line is left untouched when it does not match, it may be the first grid row.
+static char* keyword_args(char* line, const char* keyword) {
+    size_t n = strlen(keyword);
+    if (strncmp(line, keyword, n) != 0) return NULL;
+    if (line[n] != ' ' && line[n] != '\t' && line[n] != '\0') return NULL;
+    return line + n;
+}
 
 int read_level(board_t* board, char* filename, char* dirname) {
 
     char fullname[MAX_FILENAME];
-    strcpy(fullname, dirname);
-    strcat(fullname, "/");
-    strcat(fullname, filename);
+    snprintf(fullname, sizeof(fullname), "%s/%s", dirname, filename);
 
-    int fd = open(fullname, O_RDONLY);
-    if (fd == -1) {
+    line_reader_t reader;
+    if (open_lines(&reader, fullname) == -1) {
         debug("Error opening file %s\n", fullname);
         return -1;
     }
-    
-    char command[MAX_COMMAND_LENGTH];
 
     // Pacman is optional
     board->pacman_file[0] = '\0';
@@ -29,22 +109,20 @@ int read_level(board_t* board, char* filename, char* dirname) {
     strcpy(board->level_name, filename);
     *strrchr(board->level_name, '.') = '\0';
 
-    int read;
-    char *saveptr;
-    while ((read = read_line(fd, command)) > 0) {
+    char *line;
+    size_t len;
+    while ((line = read_line(&reader, &len)) != NULL) {
 
         // comment
-        if (command[0] == '#' || command[0] == '\0') continue;
+        if (line[0] == '#' || line[0] == '\0') continue;
 
-        char temp[MAX_COMMAND_LENGTH];
-        strcpy(temp, command);
+        char *word = skip_blanks(line);
+        if (*word == '\0') continue;  // skip empty line
 
-        char *word = strtok_r(temp, " \t\n", &saveptr);
-        if (!word) continue;  // skip empty line
-
-        if (strcmp(word, "DIM") == 0) {
-            char *arg1 = strtok_r(NULL, " \t\n", &saveptr);
-            char *arg2 = strtok_r(NULL, " \t\n", &saveptr);
+        char *args;
+        if ((args = keyword_args(word, "DIM")) != NULL) {
+            char *arg1 = next_word(&args);
+            char *arg2 = next_word(&args);
             if (arg1 && arg2) {
                 board->height = atoi(arg1);
                 board->width = atoi(arg2);
@@ -52,26 +130,26 @@ int read_level(board_t* board, char* filename, char* dirname) {
             }
         }
 
-        else if (strcmp(word, "TEMPO") == 0) {
-            char *arg = strtok_r(NULL, " \t\n", &saveptr);
+        else if ((args = keyword_args(word, "TEMPO")) != NULL) {
+            char *arg = next_word(&args);
             if (arg) {
                 board->tempo = atoi(arg);
                 debug("TEMPO = %d\n", board->tempo);
             }
         }
 
-        else if (strcmp(word, "PAC") == 0) {
-            char *arg = strtok_r(NULL, " \t\n", &saveptr);
+        else if ((args = keyword_args(word, "PAC")) != NULL) {
+            char *arg = next_word(&args);
             if (arg) {
                 snprintf(board->pacman_file, sizeof(board->pacman_file), "%s/%s", dirname, arg);
                 debug("PAC = %s\n", board->pacman_file);
             }
         }
 
-        else if (strcmp(word, "MON") == 0) {
+        else if ((args = keyword_args(word, "MON")) != NULL) {
             char *arg;
             int i = 0;
-            while ((arg = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+            while ((arg = next_word(&args)) != NULL) {
                 snprintf(board->ghosts_files[i], sizeof(board->ghosts_files[0]), "%s/%s", dirname, arg);
                 debug("MON file: %s\n", board->ghosts_files[i]);
                 i+= 1;
@@ -87,53 +165,47 @@ int read_level(board_t* board, char* filename, char* dirname) {
 
     if (!board->width || !board->height) {
         debug("Missing dimensions in level file\n");
-        close(fd);
+        close_lines(&reader);
         return -1;
     }
-    
+
     // the end of the file contains the grid
-    board->board = calloc(board->width * board->height, sizeof(board_pos_t));
+    if (alloc_board_cells(board) == -1) {
+        debug("Failed to allocate the board\n");
+        close_lines(&reader);
+        return -1;
+    }
     board->pacmans = calloc(board->n_pacmans, sizeof(pacman_t));
     board->ghosts = calloc(board->n_ghosts, sizeof(ghost_t));
 
     int row = 0;
-    // command here still holds the previous line
-    while (read > 0) {
-        if (command[0]== '#' || command[0] == '\0') continue;
+    // line here still holds the first row, rows are as wide as the file makes them
+    for (; line; line = read_line(&reader, &len)) {
+        if (line[0]== '#' || line[0] == '\0') continue;
         if (row >= board->height) break;
 
-        debug("Line: %s\n", command);
+        debug("Line: %s\n", line);
 
         for (int col = 0; col < board -> width; col++){
-            int idx = row * board->width + col;
-            char content = command[col];
+            char content = (size_t)col < len ? line[col] : ' ';
 
             switch (content) {
                 case 'X': // wall
-                    board->board[idx].content = 'W';
+                    set_wall(board, col, row);
                     break;
                 case '@': // portal
-                    board->board[idx].content = ' ';
-                    board->board[idx].has_portal = 1;
+                    plane_set(board->portals, board, col, row);
                     break;
                 default:
-                    board->board[idx].content = ' ';
-                    board->board[idx].has_dot = 1;
+                    plane_set(board->dots, board, col, row);
                     break;
             }
         }
 
         row++;
-        read = read_line(fd, command);
-    }
-
-    if (read == -1) {
-      debug("Failed parsing line");
-      close(fd);
-      return read;
     }
 
-    close(fd);
+    close_lines(&reader);
     return 0;
 }
 
@@ -142,7 +214,7 @@ int read_pacman(board_t* board, int points) {
     pacman->alive = 1;
     pacman->points = points;
 
-    // no file was provided -> defaults 
+    // no file was provided -> defaults
     if (board->pacman_file[0] == '\0') {
         pacman->passo = 0;
         pacman->waiting = 0;
@@ -150,11 +222,10 @@ int read_pacman(board_t* board, int points) {
         // default position -> find first non occupied cell
         for (int i = 0; i < board->height; i++) {
             for (int j = 0; j < board->width; j++) {
-                int idx = i * board->width + j;
-                if (board->board[idx].content == ' ') {
+                if (!is_wall(board, j, i) && entity_at(board, j, i) == NO_ENTITY) {
                     pacman->pos_x = j;
                     pacman->pos_y = i;
-                    board->board[idx].content = 'P';
+                    set_entity(board, j, i, PACMAN_ID(0));
                     goto pacman_inserted;
                 }
             }
@@ -164,37 +235,36 @@ int read_pacman(board_t* board, int points) {
         return 0;
     }
 
-    int fd = open(board->pacman_file, O_RDONLY);
+    line_reader_t reader;
+    if (open_lines(&reader, board->pacman_file) == -1) {
+        debug("Failed reading line\n");
+        return -1;
+    }
 
-    int read;
-    char command[MAX_COMMAND_LENGTH];
-    char *saveptr;
-    while ((read = read_line(fd, command)) > 0) {
+    char *line;
+    while ((line = read_line(&reader, NULL)) != NULL) {
         // comment
-        if (command[0] == '#' || command[0] == '\0') continue;
+        if (line[0] == '#' || line[0] == '\0') continue;
 
-        char temp[MAX_COMMAND_LENGTH];
-        strcpy(temp, command);
+        char *word = skip_blanks(line);
+        if (*word == '\0') continue;  // skip empty line
 
-        char *word = strtok_r(temp, " \t\n", &saveptr);
-        if (!word) continue;  // skip empty line
-
-        if (strcmp(word, "PASSO") == 0) {
-            char *arg = strtok_r(NULL, " \t\n", &saveptr);
+        char *args;
+        if ((args = keyword_args(word, "PASSO")) != NULL) {
+            char *arg = next_word(&args);
             if (arg) {
                 pacman->passo = atoi(arg);
                 pacman->waiting = pacman->passo;
                 debug("Pacman passo: %d\n", pacman->passo);
             }
         }
-        else if (strcmp(word, "POS") == 0) {
-            char *arg1 = strtok_r(NULL, " \t\n", &saveptr);
-            char *arg2 = strtok_r(NULL, " \t\n", &saveptr);
+        else if ((args = keyword_args(word, "POS")) != NULL) {
+            char *arg1 = next_word(&args);
+            char *arg2 = next_word(&args);
             if (arg1 && arg2) {
                 pacman->pos_y = atoi(arg1);
                 pacman->pos_x = atoi(arg2);
-                int idx = pacman->pos_y * board->width + pacman->pos_x;
-                board->board[idx].content = 'P';
+                set_entity(board, pacman->pos_x, pacman->pos_y, PACMAN_ID(0));
                 debug("Pacman Pos = %d x %d\n", pacman->pos_x, pacman->pos_y);
             }
         }
@@ -205,81 +275,73 @@ int read_pacman(board_t* board, int points) {
 
     // end of the file contains the moves
     pacman->current_move = 0;
-    
-    // command here still holds the previous line
+
+    // line here still holds the first move
     int move = 0;
-    while (read > 0 && move < MAX_MOVES) {
-        if (command[0]== '#' || command[0] == '\0') continue;
-        if (command[0] == 'A' ||
-            command[0] == 'D' ||
-            command[0] == 'W' ||
-            command[0] == 'S' ||
-            command[0] == 'R' ||
-            command[0] == 'G' ||  // FIXME: so para testar
-            command[0] == 'Q') {  // FIXME: so para testar
-                pacman->moves[move].command = command[0];
+    for (; line && move < MAX_MOVES; line = read_line(&reader, NULL)) {
+        if (line[0]== '#' || line[0] == '\0') continue;
+        if (line[0] == 'A' ||
+            line[0] == 'D' ||
+            line[0] == 'W' ||
+            line[0] == 'S' ||
+            line[0] == 'R' ||
+            line[0] == 'G' ||  // FIXME: so para testar
+            line[0] == 'Q') {  // FIXME: so para testar
+                pacman->moves[move].command = line[0];
                 pacman->moves[move].turns = 1;
                 move += 1;
         }
-        else if (command[0] == 'T' && command[1] == ' ') { 
-            int t = atoi(command+2);
+        else if (line[0] == 'T' && line[1] == ' ') {
+            int t = atoi(line+2);
             if (t > 0) {
-                pacman->moves[move].command = command[0];
+                pacman->moves[move].command = line[0];
                 pacman->moves[move].turns = t;
                 pacman->moves[move].turns_left = t;
                 move += 1;
             }
         }
-
-        read = read_line(fd, command);
     }
     pacman->n_moves = move;
 
-    if (read == -1) {
-        debug("Failed reading line\n");
-        close(fd);
-        return -1;
-    }
-
-    close(fd);
+    close_lines(&reader);
     return 0;
 }
 
 
 int read_ghosts(board_t* board) {
     for (int i = 0; i < board->n_ghosts; i++) {
-        int fd = open(board->ghosts_files[i], O_RDONLY);
         ghost_t* ghost = &board->ghosts[i];
 
-        int read;
-        char command[MAX_COMMAND_LENGTH];
-        char *saveptr;
-        while ((read = read_line(fd, command)) > 0) {
-            // comment
-            if (command[0] == '#' || command[0] == '\0') continue;
+        line_reader_t reader;
+        if (open_lines(&reader, board->ghosts_files[i]) == -1) {
+            debug("Failed reading line\n");
+            return -1;
+        }
 
-            char temp[MAX_COMMAND_LENGTH];
-            strcpy(temp, command);
+        char *line;
+        while ((line = read_line(&reader, NULL)) != NULL) {
+            // comment
+            if (line[0] == '#' || line[0] == '\0') continue;
 
-            char *word = strtok_r(temp, " \t\n", &saveptr);
-            if (!word) continue;  // skip empty line
+            char *word = skip_blanks(line);
+            if (*word == '\0') continue;  // skip empty line
 
-            if (strcmp(word, "PASSO") == 0) {
-                char *arg = strtok_r(NULL, " \t\n", &saveptr);
+            char *args;
+            if ((args = keyword_args(word, "PASSO")) != NULL) {
+                char *arg = next_word(&args);
                 if (arg) {
                     ghost->passo = atoi(arg);
                     ghost->waiting = ghost->passo;
                     debug("Ghost passo: %d\n", ghost->passo);
                 }
             }
-            else if (strcmp(word, "POS") == 0) {
-                char *arg1 = strtok_r(NULL, " \t\n", &saveptr);
-                char *arg2 = strtok_r(NULL, " \t\n", &saveptr);
+            else if ((args = keyword_args(word, "POS")) != NULL) {
+                char *arg1 = next_word(&args);
+                char *arg2 = next_word(&args);
                 if (arg1 && arg2) {
                     ghost->pos_y = atoi(arg1);
                     ghost->pos_x = atoi(arg2);
-                    int idx = ghost->pos_y * board->width + ghost->pos_x;
-                    board->board[idx].content = 'M';
+                    set_entity(board, ghost->pos_x, ghost->pos_y, GHOST_ID(i));
                     debug("Ghost Pos = %d x %d\n", ghost->pos_x, ghost->pos_y);
                 }
             }
@@ -291,58 +353,34 @@ int read_ghosts(board_t* board) {
         // end of the file contains the moves
         ghost->current_move = 0;
 
-        // command here still holds the previous line
+        // line here still holds the first move
         int move = 0;
-        while (read > 0 && move < MAX_MOVES) {
-            if (command[0]== '#' || command[0] == '\0') continue;
-            if (command[0] == 'A' ||
-                command[0] == 'D' ||
-                command[0] == 'W' ||
-                command[0] == 'S' ||
-                command[0] == 'R' ||
-                command[0] == 'C') {
-                    ghost->moves[move].command = command[0];
-                    ghost->moves[move].turns = 1; 
+        for (; line && move < MAX_MOVES; line = read_line(&reader, NULL)) {
+            if (line[0]== '#' || line[0] == '\0') continue;
+            if (line[0] == 'A' ||
+                line[0] == 'D' ||
+                line[0] == 'W' ||
+                line[0] == 'S' ||
+                line[0] == 'R' ||
+                line[0] == 'C') {
+                    ghost->moves[move].command = line[0];
+                    ghost->moves[move].turns = 1;
                     move += 1;
             }
-            else if (command[0] == 'T' && command[1] == ' ') {
-                int t = atoi(command+2);
+            else if (line[0] == 'T' && line[1] == ' ') {
+                int t = atoi(line+2);
                 if (t > 0) {
-                    ghost->moves[move].command = command[0];
+                    ghost->moves[move].command = line[0];
                     ghost->moves[move].turns = t;
                     ghost->moves[move].turns_left = t;
                     move += 1;
                 }
             }
-            read = read_line(fd, command);
         }
         ghost->n_moves = move;
 
-        if (read == -1) {
-            debug("Failed reading line\n");
-            close(fd);
-            return -1;
-        }
-        close(fd);
+        close_lines(&reader);
     }
 
     return 0;
 }
-
-int read_line(int fd, char *buf) {
-    int i = 0;
-    char c;
-    ssize_t n;
-
-    while ((n = read(fd, &c, 1)) == 1) {
-        if (c == '\r') continue;
-        if (c == '\n') break;
-        buf[i++] = c;
-        if (i == MAX_COMMAND_LENGTH - 1) break;
-    }
-
-    buf[i] = '\0';
-    if (n == -1) return -1;
-    if (n == 0 && i == 0) return 0;
-    return 1;
-}
@@ -0,0 +1,90 @@
+#include "replay.h"
+#include "board.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+static int write_all(int fd, const void *buf, size_t size) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+int replay_create(char *dir, int id, uint64_t seed, char *levels) {
+    char path[MAX_FILENAME];
+    snprintf(path, sizeof(path), "%s/session-%d.log", dir, id);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+
+    replay_header_t header = {0};
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.seed = seed;
+    snprintf(header.levels, sizeof(header.levels), "%s", levels);
+    if (write_all(fd, &header, sizeof(header)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int replay_append(int fd, char kind, int level, unsigned long tick, char command, uint64_t value) {
+    replay_record_t record = {0};
+    record.tick = tick;
+    record.level = level;
+    record.kind = kind;
+    record.command = command;
+    record.value = value;
+    // one write per record, O_APPEND keeps records whole even if the server dies mid run
+    return write_all(fd, &record, sizeof(record));
+}
+
+int replay_load(char *path, replay_header_t *header, replay_record_t **records, size_t *n_records) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(replay_header_t)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    char *buf = malloc(st.st_size);
+    size_t got = 0;
+    while (buf && got < (size_t)st.st_size) {
+        ssize_t n = read(fd, buf + got, st.st_size - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+
+    if (!buf || got < sizeof(replay_header_t) || memcmp(buf, REPLAY_MAGIC, sizeof(header->magic)) != 0) {
+        free(buf);
+        errno = EINVAL;
+        return -1;
+    }
+
+    memcpy(header, buf, sizeof(replay_header_t));
+    *n_records = (got - sizeof(replay_header_t)) / sizeof(replay_record_t);
+    *records = malloc(*n_records * sizeof(replay_record_t) + 1);
+    if (!*records) {
+        free(buf);
+        return -1;
+    }
+    memcpy(*records, buf + sizeof(replay_header_t), *n_records * sizeof(replay_record_t));
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,314 @@
+#include "scheduler.h"
+#include "board.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+
+/*
+Hierarchical timer wheel with a 1ms resolution.
+The root level has one slot per millisecond for the next 256ms, every upper
+level has 64 slots, each one as wide as a whole lap of the level below.
+When the root wraps around, the next slot of the level above is cascaded down,
+so every task is touched at most WHEEL_LEVELS times before it is due.
+*/
+#define WHEEL_LEVELS 4
+#define ROOT_BITS 8
+#define LEVEL_BITS 6
+#define ROOT_SIZE (1 << ROOT_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define MAX_DELAY_MS ((1ULL << (ROOT_BITS + (WHEEL_LEVELS - 1) * LEVEL_BITS)) - 1)
+
+typedef struct task {
+    task_fn_t fn;
+    void *arg;
+    uint64_t deadline; // absolute, in ms of CLOCK_MONOTONIC
+    int worker; // worker that ran the task last, gets it back when it is due
+    struct task *next;
+} task_t;
+
+// Double ended queue of ready tasks, owned by one worker.
+// The owner pops from the front, idle workers steal from the back.
+typedef struct {
+    task_t **buf;
+    int head;
+    int count;
+    int capacity;
+    pthread_mutex_t lock;
+} deque_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    deque_t queue;
+} worker_t;
+
+static struct {
+    task_t *root[ROOT_SIZE];
+    task_t *levels[WHEEL_LEVELS - 1][LEVEL_SIZE];
+    uint64_t now; // wheel time, every slot up to it was already expired
+    uint64_t wake_at; // when the timer thread will wake up, 0 if not sleeping on a deadline
+    int pending; // tasks currently in the wheel
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} wheel;
+
+static struct {
+    worker_t *workers;
+    int n_workers;
+    int next_worker; // round robin for new tasks
+    sem_t ready; // number of tasks waiting in the deques
+} pool;
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int scheduler_default_workers() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+// Deques
+
+static void deque_push(deque_t *q, task_t *task) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        int capacity = q->capacity ? q->capacity * 2 : 16;
+        task_t **buf = malloc(capacity * sizeof(task_t*));
+        for (int i = 0; i < q->count; i++) {
+            buf[i] = q->buf[(q->head + i) % q->capacity];
+        }
+        free(q->buf);
+        q->buf = buf;
+        q->head = 0;
+        q->capacity = capacity;
+    }
+    q->buf[(q->head + q->count) % q->capacity] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static task_t* deque_pop_front(deque_t *q) {
+    task_t *task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        task = q->buf[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+static task_t* deque_steal(deque_t *q) {
+    task_t *task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        q->count--;
+        task = q->buf[(q->head + q->count) % q->capacity];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+// Hands a due task to the worker that ran it last
+static void dispatch(task_t *task) {
+    deque_push(&pool.workers[task->worker].queue, task);
+    sem_post(&pool.ready);
+}
+
+// Timer wheel, every function below expects wheel.lock to be held
+
+static void wheel_insert(task_t *task) {
+    uint64_t delta = task->deadline - wheel.now;
+    if (delta > MAX_DELAY_MS) {
+        delta = MAX_DELAY_MS;
+        task->deadline = wheel.now + delta;
+    }
+
+    task_t **slot;
+    if (delta < ROOT_SIZE) {
+        slot = &wheel.root[task->deadline & ROOT_MASK];
+    }
+    else {
+        int level = 0;
+        while (delta >= (1ULL << (ROOT_BITS + (level + 1) * LEVEL_BITS))) level++;
+        int shift = ROOT_BITS + level * LEVEL_BITS;
+        slot = &wheel.levels[level][(task->deadline >> shift) & LEVEL_MASK];
+    }
+    task->next = *slot;
+    *slot = task;
+}
+
+// Re-inserts every task of an upper level slot, they all end up in lower levels
+static void wheel_cascade(int level, int index) {
+    task_t *task = wheel.levels[level][index];
+    wheel.levels[level][index] = NULL;
+    while (task) {
+        task_t *next = task->next;
+        wheel_insert(task);
+        task = next;
+    }
+}
+
+// Moves the wheel up to target and returns the list of tasks that became due
+static task_t* wheel_advance(uint64_t target) {
+    task_t *due = NULL;
+    while (wheel.now < target) {
+        wheel.now++;
+
+        int index = wheel.now & ROOT_MASK;
+        for (int level = 0; index == 0 && level < WHEEL_LEVELS - 1; level++) {
+            index = (wheel.now >> (ROOT_BITS + level * LEVEL_BITS)) & LEVEL_MASK;
+            wheel_cascade(level, index);
+        }
+
+        task_t *task = wheel.root[wheel.now & ROOT_MASK];
+        wheel.root[wheel.now & ROOT_MASK] = NULL;
+        while (task) {
+            task_t *next = task->next;
+            task->next = due;
+            due = task;
+            wheel.pending--;
+            task = next;
+        }
+    }
+    return due;
+}
+
+// First time the wheel has something to do: the next busy root slot or the next cascade
+static uint64_t wheel_next_expiry() {
+    uint64_t boundary = (wheel.now | ROOT_MASK) + 1;
+    for (uint64_t t = wheel.now + 1; t < boundary; t++) {
+        if (wheel.root[t & ROOT_MASK]) return t;
+    }
+    return boundary;
+}
+
+static void* timer_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&wheel.lock);
+    while (true) {
+        task_t *due = wheel_advance(now_ms());
+        if (due) {
+            pthread_mutex_unlock(&wheel.lock);
+            while (due) {
+                task_t *next = due->next;
+                dispatch(due);
+                due = next;
+            }
+            pthread_mutex_lock(&wheel.lock);
+            continue;
+        }
+
+        if (wheel.pending == 0) {
+            pthread_cond_wait(&wheel.cond, &wheel.lock);
+            continue;
+        }
+
+        wheel.wake_at = wheel_next_expiry();
+        struct timespec ts = { .tv_sec = wheel.wake_at / 1000, .tv_nsec = (wheel.wake_at % 1000) * 1000000 };
+        pthread_cond_timedwait(&wheel.cond, &wheel.lock, &ts);
+        wheel.wake_at = 0;
+    }
+    return NULL;
+}
+
+static void schedule(task_t *task, int delay_ms) {
+    if (delay_ms <= 0) {
+        dispatch(task);
+        return;
+    }
+
+    pthread_mutex_lock(&wheel.lock);
+    uint64_t now = now_ms();
+    if (wheel.pending == 0 && wheel.now < now) {
+        wheel.now = now; // nothing to cascade, skip the idle time
+    }
+    task->deadline = now + delay_ms;
+    wheel_insert(task);
+    wheel.pending++;
+    if (wheel.wake_at == 0 || task->deadline < wheel.wake_at) {
+        pthread_cond_signal(&wheel.cond);
+    }
+    pthread_mutex_unlock(&wheel.lock);
+}
+
+static void* worker_thread(void *arg) {
+    worker_t *self = (worker_t*) arg;
+
+    while (true) {
+        // every successful wait reserves one task that is in some deque
+        while (sem_wait(&pool.ready) == -1 && errno == EINTR);
+
+        task_t *task = deque_pop_front(&self->queue);
+        for (int i = 1; !task; i++) {
+            task = deque_steal(&pool.workers[(self->id + i) % pool.n_workers].queue);
+        }
+
+        int delay = task->fn(task->arg);
+        if (delay < 0) {
+            free(task);
+            continue;
+        }
+        task->worker = self->id;
+        schedule(task, delay);
+    }
+    return NULL;
+}
+
+int scheduler_start(int n_workers) {
+    if (n_workers <= 0) n_workers = scheduler_default_workers();
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&wheel.lock, NULL);
+    wheel.now = now_ms();
+
+    sem_init(&pool.ready, 0, 0);
+    pool.n_workers = n_workers;
+    pool.workers = calloc(n_workers, sizeof(worker_t));
+    for (int i = 0; i < n_workers; i++) {
+        pool.workers[i].id = i;
+        pthread_mutex_init(&pool.workers[i].queue.lock, NULL);
+    }
+
+    for (int i = 0; i < n_workers; i++) {
+        if (pthread_create(&pool.workers[i].tid, NULL, worker_thread, &pool.workers[i]) != 0) return -1;
+        pthread_detach(pool.workers[i].tid);
+    }
+
+    pthread_t timer_tid;
+    if (pthread_create(&timer_tid, NULL, timer_thread, NULL) != 0) return -1;
+    pthread_detach(timer_tid);
+
+    debug("Scheduler started with %d workers\n", n_workers);
+    return 0;
+}
+
+void scheduler_submit(task_fn_t fn, void *arg, int delay_ms) {
+    task_t *task = malloc(sizeof(task_t));
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&wheel.lock);
+    task->worker = pool.next_worker;
+    pool.next_worker = (pool.next_worker + 1) % pool.n_workers;
+    pthread_mutex_unlock(&wheel.lock);
+
+    schedule(task, delay_ms);
+}
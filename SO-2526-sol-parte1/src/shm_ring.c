@@ -0,0 +1,57 @@
+#include "shm_ring.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+shm_ring_t* shm_ring_create(const char* name, int n_slots, size_t slot_size) {
+    if (n_slots < 1) n_slots = 1;
+    size_t size = shm_ring_size(n_slots, slot_size);
+
+    // the client runs as the same user, nobody else may write frames into it
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) return NULL;
+    if (ftruncate(fd, size) == -1) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    shm_ring_t *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // a fresh segment is zeroed: head, tail and waiting start at 0
+    ring->n_slots = n_slots;
+    ring->slot_size = slot_size;
+    return ring;
+}
+
+void shm_ring_destroy(shm_ring_t* ring, const char* name) {
+    if (!ring) return;
+    munmap(ring, shm_ring_size(ring->n_slots, ring->slot_size));
+    shm_unlink(name);
+}
+
+int shm_ring_empty(shm_ring_t* ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+        atomic_load_explicit(&ring->head, memory_order_relaxed);
+}
+
+int shm_ring_publish(shm_ring_t* ring, const char* data, size_t size) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    // the client is done with a slot once tail moves past it
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == ring->n_slots) return -1;
+
+    shm_slot_t *slot = shm_ring_slot(ring, head);
+    slot->size = size;
+    memcpy(slot->data, data, size);
+
+    // seq_cst pairs with the client setting waiting and then reading head:
+    // either it sees this frame or we see it waiting
+    atomic_store(&ring->head, head + 1);
+    return atomic_exchange(&ring->waiting, 0);
+}
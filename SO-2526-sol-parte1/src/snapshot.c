@@ -0,0 +1,80 @@
+#include "snapshot.h"
+#include "frame.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sched.h>
+
+// The grid is copied with plain loads and stores between the fences, like any
+// seqlock: a reader that raced with a writer throws its copy away.
+
+static void write_begin(board_snapshot_t* snap) {
+    unsigned seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    atomic_store_explicit(&snap->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(board_snapshot_t* snap) {
+    unsigned seq = atomic_load_explicit(&snap->seq, memory_order_relaxed);
+    atomic_store_explicit(&snap->seq, seq + 1, memory_order_release);
+}
+
+unsigned snapshot_begin(board_snapshot_t* snap) {
+    return atomic_load_explicit(&snap->seq, memory_order_acquire);
+}
+
+int snapshot_retry(board_snapshot_t* snap, unsigned seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return (seq & 1) || atomic_load_explicit(&snap->seq, memory_order_relaxed) != seq;
+}
+
+int snapshot_init(board_snapshot_t* snap, size_t max_cells) {
+    snap->grid = malloc(max_cells ? max_cells : 1);
+    if (!snap->grid) return -1;
+    snap->capacity = max_cells;
+    return 0;
+}
+
+void snapshot_destroy(board_snapshot_t* snap) {
+    free(snap->grid);
+    snap->grid = NULL;
+    snap->capacity = 0;
+}
+
+int snapshot_publish(board_snapshot_t* snap, board_t* board) {
+    size_t size = (size_t)board->width * board->height;
+    if (size > snap->capacity) return -1;
+
+    write_begin(snap);
+    snprintf(snap->level_name, sizeof(snap->level_name), "%s", board->level_name);
+    snap->width = board->width;
+    snap->height = board->height;
+    snap->tempo = board->tempo;
+    snap->points = board->pacmans[0].points;
+    render_board(board, snap->grid);
+    write_end(snap);
+    return 0;
+}
+
+void snapshot_update(board_snapshot_t* snap, board_t* board, const int* xy, int n) {
+    write_begin(snap);
+    for (int i = 0; i < n; i++) {
+        int x = xy[2 * i], y = xy[2 * i + 1];
+        if (x < 0 || y < 0 || x >= snap->width || y >= snap->height) continue;
+        snap->grid[y * snap->width + x] = cell_glyph(board, x, y);
+    }
+    snap->points = board->pacmans[0].points;
+    write_end(snap);
+}
+
+int snapshot_read(board_snapshot_t* snap, char* grid) {
+    int points;
+    unsigned seq;
+    do {
+        // a writer only touches a few cells, let it finish instead of spinning
+        while ((seq = snapshot_begin(snap)) & 1) sched_yield();
+        memcpy(grid, snap->grid, (size_t)snap->width * snap->height);
+        points = snap->points;
+    } while (snapshot_retry(snap, seq));
+    return points;
+}
@@ -1,6 +1,8 @@
 #ifndef API_H
 #define API_H
 
+#include "protocol.h"
+
 typedef struct {
   int width;
   int height;
@@ -11,6 +13,50 @@ typedef struct {
   char* data;
 } Board;
 
+/// A connection to the server. Play and disconnect may be called from one
+/// thread while another receives; sessions share nothing with each other.
+typedef struct Session pacman_session_t;
+
+/// @return the new session, or NULL if the connection failed.
+pacman_session_t *pacman_session_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
+
+/// Same as pacman_session_connect, but asks the server to publish the frames in
+/// shared memory and only use the pipe to wake the client. Servers that can't
+/// keep sending them through the pipe.
+pacman_session_t *pacman_session_connect_shm(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
+
+/// Watches game game_id, or the oldest running game if it is 0, without playing:
+/// the session receives the player's frames and play does nothing. Waits for
+/// the first frame. Free the session to stop watching.
+/// @return the new session, or NULL if there is no such game or the connection failed.
+pacman_session_t *pacman_session_spectate(char const *notif_pipe_path, char const *server_pipe_path, int game_id);
+
+void pacman_session_play(pacman_session_t *session, char command);
+
+/// Tells the server the client is leaving. The session can still receive
+/// until the server closes the notification pipe.
+/// @return 0 if the disconnection was successful, 1 otherwise.
+int pacman_session_disconnect(pacman_session_t *session);
+
+/// Disconnects if needed, interrupts a receive in progress, which returns a
+/// game over board, and frees the session once it returned.
+void pacman_session_free(pacman_session_t *session);
+
+/// Same as receive_board_update, for one session.
+Board pacman_session_receive(pacman_session_t *session);
+
+/// Notification pipe, readable when a frame starts arriving. pacman_session_receive
+/// then blocks only until the rest of the frame is in.
+int pacman_session_notif_fd(pacman_session_t *session);
+
+/// Maps the ring an OP_CODE_SHM_ATTACH message names and removes the name, for
+/// clients that read the notification pipe themselves. The ring is checked to
+/// fit in the mapping, so its slots can be read without further bounds checks.
+/// @return the ring, mapped *size bytes long, or NULL if it can't be mapped or is malformed.
+shm_ring_t *pacman_shm_attach(const char *name, size_t *size);
+
+// Single-session API, on a session owned by the library
+
 int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path);
 
 void pacman_play(char command);
@@ -18,8 +64,9 @@ void pacman_play(char command);
 /// @return 0 if the disconnection was successful, 1 otherwise.
 int pacman_disconnect();
 
-Board receive_board_update(void);
-
+/// Waits for the next board. Keyframes replace the board and deltas are applied
+/// on top of it; deltas that do not follow the last frame are skipped.
+/// @return the board, whose data is owned by the API and valid until the next call.
 Board receive_board_update(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "api.h"
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/*
+Micro-benchmark of receive_board_update decoding, over the same matrix of
+board sizes and ghost counts as the server's bench.
+A thread plays the server and streams a keyframe followed by deltas, as the
+server sends them with the default keyframe interval, while the main thread
+decodes as fast as it can.
+Prints one key=value line per result so runs of two commits can be diffed.
+Usage: bench [-t ms]
+*/
+
+static const int SIZES[] = {10, 100, 500, 1000, 2000};
+static const int GHOSTS[] = {1, 8, 24};
+#define N_SIZES (int)(sizeof(SIZES) / sizeof(SIZES[0]))
+#define N_GHOST_COUNTS (int)(sizeof(GHOSTS) / sizeof(GHOSTS[0]))
+
+#define KEYFRAME_INTERVAL 50
+
+static int budget_ms = 100; // -t: time spent on every result
+
+typedef struct {
+  char server_path[MAX_PIPE_PATH_LENGTH];
+  char *frames; // one keyframe and KEYFRAME_INTERVAL - 1 deltas, streamed in a loop
+  size_t size;
+} feeder_t;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Builds the frames a size x size board with n_ghosts moving ghosts produces.
+// Returns -1 if out of memory.
+static int build_frames(feeder_t *feeder, int size, int n_ghosts) {
+  int n_cells = 2 * (1 + n_ghosts); // every entity leaves a cell and enters another
+  feeder->size = sizeof(msg_board_header_t) + (size_t)size * size +
+    (KEYFRAME_INTERVAL - 1) * (sizeof(msg_board_delta_t) + n_cells * sizeof(msg_board_cell_t));
+  feeder->frames = malloc(feeder->size);
+  if (!feeder->frames) return -1;
+
+  char *p = feeder->frames;
+  msg_board_header_t key = {OP_CODE_BOARD, size, size, 10, 0, 0, 0, 0};
+  memcpy(p, &key, sizeof(key));
+  p += sizeof(key);
+  memset(p, '.', (size_t)size * size);
+  p += (size_t)size * size;
+
+  for (int seq = 1; seq < KEYFRAME_INTERVAL; seq++) {
+    msg_board_delta_t delta = {OP_CODE_BOARD_DELTA, seq, 10, 0, 0, seq, n_cells};
+    memcpy(p, &delta, sizeof(delta));
+    p += sizeof(delta);
+    for (int i = 0; i < n_cells; i++) {
+      msg_board_cell_t cell = {0};
+      cell.index = (int)(((uint64_t)seq * 7919 + i * 104729) % ((uint64_t)size * size));
+      cell.glyph = i % 2 ? 'M' : '.';
+      memcpy(p, &cell, sizeof(cell));
+      p += sizeof(cell);
+    }
+  }
+  return 0;
+}
+
+// Accepts the connection like the server does and streams the frames until the client leaves
+static void* feeder_thread(void *arg) {
+  feeder_t *feeder = arg;
+
+  int server_fd = open(feeder->server_path, O_RDONLY);
+  msg_connect_t msg;
+  if (server_fd == -1 || read(server_fd, &msg, sizeof(msg)) != sizeof(msg)) return NULL;
+  close(server_fd);
+
+  int notif_fd = open(msg.notif_pipe_path, O_WRONLY);
+  int req_fd = open(msg.req_pipe_path, O_RDONLY);
+
+  int done = 0;
+  while (!done) {
+    for (size_t sent = 0; sent < feeder->size; ) {
+      ssize_t n = write(notif_fd, feeder->frames + sent, feeder->size - sent);
+      if (n <= 0) {
+        done = 1; // client disconnected
+        break;
+      }
+      sent += n;
+    }
+  }
+
+  close(notif_fd);
+  close(req_fd);
+  return NULL;
+}
+
+static int bench_receive(int size, int n_ghosts) {
+  char req_path[MAX_PIPE_PATH_LENGTH], notif_path[MAX_PIPE_PATH_LENGTH];
+  feeder_t feeder;
+  snprintf(feeder.server_path, sizeof(feeder.server_path), "/tmp/bench_%d_server", getpid());
+  snprintf(req_path, sizeof(req_path), "/tmp/bench_%d_request", getpid());
+  snprintf(notif_path, sizeof(notif_path), "/tmp/bench_%d_notification", getpid());
+
+  if (build_frames(&feeder, size, n_ghosts) == -1 || mkfifo(feeder.server_path, 0666) == -1) {
+    perror("bench setup");
+    free(feeder.frames);
+    return -1;
+  }
+
+  pthread_t tid;
+  pthread_create(&tid, NULL, feeder_thread, &feeder);
+  pacman_session_t *session = pacman_session_connect(req_path, notif_path, feeder.server_path);
+  if (!session) {
+    unlink(feeder.server_path);
+    free(feeder.frames);
+    return -1;
+  }
+
+  unsigned long ops = 0;
+  uint64_t budget = (uint64_t) budget_ms * 1000000;
+  uint64_t start = now_ns(), elapsed = 0;
+  int result = 0;
+  while (elapsed < budget && result == 0) {
+    for (int i = 0; i < KEYFRAME_INTERVAL; i++) {
+      Board board = pacman_session_receive(session);
+      if (board.game_over) {
+        // the numbers so far would look plausible, don't print any
+        fprintf(stderr, "feeder stopped early\n");
+        result = -1;
+        break;
+      }
+    }
+    ops += KEYFRAME_INTERVAL;
+    elapsed = now_ns() - start;
+  }
+
+  pacman_session_free(session);
+  pthread_join(tid, NULL);
+  unlink(feeder.server_path);
+  free(feeder.frames);
+  if (result != 0) return result;
+
+  printf("bench=receive_board_update width=%d height=%d ghosts=%d ops=%lu ns_per_op=%.1f ops_per_s=%.0f\n",
+    size, size, n_ghosts, ops, (double) elapsed / ops, ops * 1e9 / elapsed);
+  fflush(stdout);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+      case 't':
+        budget_ms = atoi(optarg);
+        break;
+      default:
+        printf("Usage: %s [-t ms]\n", argv[0]);
+        return -1;
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN); // the feeder learns the client left from EPIPE
+
+  for (int s = 0; s < N_SIZES; s++) {
+    for (int g = 0; g < N_GHOST_COUNTS; g++) {
+      if (bench_receive(SIZES[s], GHOSTS[g]) != 0) return 1;
+    }
+  }
+  return 0;
+}
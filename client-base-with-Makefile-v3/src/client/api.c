@@ -9,6 +9,10 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 struct Session {
   int id;
@@ -16,25 +20,68 @@ struct Session {
   int notif_pipe_fd;
   char req_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
   char notif_pipe_path[MAX_PIPE_PATH_LENGTH + 1];
+  char *board_data; // last board received, deltas are applied on top of it
+  int width;
+  int height;
+  int seq; // sequence number of board_data
+  shm_ring_t *ring; // frames come through here once the server attached it
+  size_t ring_size;
+  const char *src; // frame being read from the ring, NULL reads from the pipe
+  size_t src_left;
+  int wake_fds[2]; // self-pipe polled with the notification pipe, see session_close
+  atomic_int closing; // set before waking a blocked receive, later receives return at once
+  pthread_mutex_t req_lock;  // request pipe: play and disconnect
+  pthread_mutex_t recv_lock; // notification pipe and board_data
 };
 
-static struct Session session = {.id = -1, .req_pipe_fd = -1, .notif_pipe_fd = -1};
+// session behind the single-session functions
+static struct Session session = {
+  .id = -1, .req_pipe_fd = -1, .notif_pipe_fd = -1, .wake_fds = {-1, -1},
+  .req_lock = PTHREAD_MUTEX_INITIALIZER, .recv_lock = PTHREAD_MUTEX_INITIALIZER
+};
 
-int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
-  strncpy(session.req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH);
-  strncpy(session.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+#define CELL_BATCH 256
+
+// Last step of connecting: the notification pipe becomes non blocking, so a
+// receive waits in poll where session_close can wake it up
+static int session_start(struct Session *s) {
+  if (pipe(s->wake_fds) == -1) {
+    perror("Failed to create wake pipe");
+    if (s->req_pipe_fd != -1) close(s->req_pipe_fd);
+    close(s->notif_pipe_fd);
+    s->req_pipe_fd = -1;
+    s->notif_pipe_fd = -1;
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
+    return 1;
+  }
+  fcntl(s->notif_pipe_fd, F_SETFL, fcntl(s->notif_pipe_fd, F_GETFL) | O_NONBLOCK);
+
+  atomic_store(&s->closing, 0);
+  s->id = 1;
+  s->ring = NULL;
+  s->src = NULL;
+  s->board_data = NULL;
+  s->width = 0;
+  s->height = 0;
+  return 0;
+}
+
+static int session_connect(struct Session *s, int op_code, char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  strncpy(s->req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH);
+  strncpy(s->notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
 
-  if (mkfifo(session.req_pipe_path, 0666) == -1) {
+  if (mkfifo(s->req_pipe_path, 0666) == -1) {
     if (errno != EEXIST) {
       perror("Failed to create request pipe");
       return 1;
     }
   }
 
-  if (mkfifo(session.notif_pipe_path, 0666) == -1) {
+  if (mkfifo(s->notif_pipe_path, 0666) == -1) {
     if (errno != EEXIST) {
       perror("Failed to create notification pipe");
-      unlink(session.req_pipe_path);
+      unlink(s->req_pipe_path);
       return 1;
     }
   }
@@ -42,126 +89,457 @@ int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char
   int server_fd = open(server_pipe_path, O_WRONLY);
   if (server_fd == -1) {
     perror("Failed to open server pipe");
-    unlink(session.req_pipe_path);
-    unlink(session.notif_pipe_path);
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
     return 1;
   }
 
   msg_connect_t msg;
-  msg.op_code = OP_CODE_CONNECT;
+  msg.op_code = op_code;
   strncpy(msg.req_pipe_path, req_pipe_path, MAX_PIPE_PATH_LENGTH);
   strncpy(msg.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
 
   if (write(server_fd, &msg, sizeof(msg)) == -1) {
     perror("Failed to send connect request");
     close(server_fd);
-    unlink(session.req_pipe_path);
-    unlink(session.notif_pipe_path);
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
     return 1;
   }
   close(server_fd);
 
-  session.notif_pipe_fd = open(session.notif_pipe_path, O_RDONLY);
-  if (session.notif_pipe_fd == -1) {
+  s->notif_pipe_fd = open(s->notif_pipe_path, O_RDONLY);
+  if (s->notif_pipe_fd == -1) {
     perror("Failed to open notification pipe");
-    unlink(session.req_pipe_path);
-    unlink(session.notif_pipe_path);
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
     return 1;
   }
 
-  session.req_pipe_fd = open(session.req_pipe_path, O_WRONLY);
-  if (session.req_pipe_fd == -1) {
+  s->req_pipe_fd = open(s->req_pipe_path, O_WRONLY);
+  if (s->req_pipe_fd == -1) {
     perror("Failed to open request pipe");
-    close(session.notif_pipe_fd);
-    unlink(session.req_pipe_path);
-    unlink(session.notif_pipe_path);
+    close(s->notif_pipe_fd);
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
     return 1;
   }
 
-  session.id = 1;
-  return 0;
+  return session_start(s);
 }
 
-int pacman_disconnect() {
-  if (session.id == -1) return 0;
+static pacman_session_t *session_new(int op_code, char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  struct Session *s = calloc(1, sizeof(struct Session));
+  if (!s) return NULL;
+  s->id = -1;
+  s->req_pipe_fd = -1;
+  s->notif_pipe_fd = -1;
+  s->wake_fds[0] = s->wake_fds[1] = -1;
+
+  if (session_connect(s, op_code, req_pipe_path, notif_pipe_path, server_pipe_path) != 0) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->req_lock, NULL);
+  pthread_mutex_init(&s->recv_lock, NULL);
+  return s;
+}
+
+pacman_session_t *pacman_session_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  return session_new(OP_CODE_CONNECT, req_pipe_path, notif_pipe_path, server_pipe_path);
+}
+
+pacman_session_t *pacman_session_connect_shm(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  return session_new(OP_CODE_CONNECT_SHM, req_pipe_path, notif_pipe_path, server_pipe_path);
+}
+
+// The notification pipe is opened before asking, so the server's non blocking
+// open finds a reader, and then waits until the server sent the first frame or
+// closed its end because there is no such game
+static int session_spectate(struct Session *s, char const *notif_pipe_path, char const *server_pipe_path, int game_id) {
+  strncpy(s->notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+
+  if (mkfifo(s->notif_pipe_path, 0666) == -1) {
+    if (errno != EEXIST) {
+      perror("Failed to create notification pipe");
+      return 1;
+    }
+  }
+
+  s->notif_pipe_fd = open(s->notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  if (s->notif_pipe_fd == -1) {
+    perror("Failed to open notification pipe");
+    unlink(s->notif_pipe_path);
+    return 1;
+  }
+
+  int server_fd = open(server_pipe_path, O_WRONLY);
+  if (server_fd == -1) {
+    perror("Failed to open server pipe");
+    close(s->notif_pipe_fd);
+    unlink(s->notif_pipe_path);
+    return 1;
+  }
+
+  msg_spectate_t msg = {0};
+  msg.op_code = OP_CODE_SPECTATE;
+  strncpy(msg.notif_pipe_path, notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  msg.game_id = game_id;
+
+  if (write(server_fd, &msg, sizeof(msg)) == -1) {
+    perror("Failed to send spectate request");
+    close(server_fd);
+    close(s->notif_pipe_fd);
+    unlink(s->notif_pipe_path);
+    return 1;
+  }
+  close(server_fd);
+
+  struct pollfd pfd = { .fd = s->notif_pipe_fd, .events = POLLIN };
+  while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+  unlink(s->notif_pipe_path); // the server has it open by now, or never will
+  if (!(pfd.revents & POLLIN)) {
+    close(s->notif_pipe_fd);
+    return 1;
+  }
+  return session_start(s);
+}
+
+pacman_session_t *pacman_session_spectate(char const *notif_pipe_path, char const *server_pipe_path, int game_id) {
+  struct Session *s = calloc(1, sizeof(struct Session));
+  if (!s) return NULL;
+  s->id = -1;
+  s->req_pipe_fd = -1;
+  s->notif_pipe_fd = -1;
+  s->wake_fds[0] = s->wake_fds[1] = -1;
+
+  if (session_spectate(s, notif_pipe_path, server_pipe_path, game_id) != 0) {
+    free(s);
+    return NULL;
+  }
+  pthread_mutex_init(&s->req_lock, NULL);
+  pthread_mutex_init(&s->recv_lock, NULL);
+  return s;
+}
+
+int pacman_session_disconnect(pacman_session_t *s) {
+  pthread_mutex_lock(&s->req_lock);
+  if (s->req_pipe_fd == -1) {
+    pthread_mutex_unlock(&s->req_lock);
+    return 0;
+  }
 
   msg_disconnect_t msg;
   msg.op_code = OP_CODE_DISCONNECT;
-  if (write(session.req_pipe_fd, &msg, sizeof(msg)) == -1) {
+  int result = 0;
+  if (write(s->req_pipe_fd, &msg, sizeof(msg)) == -1) {
       perror("Failed to send disconnect");
+      result = 1;
   }
 
-  close(session.req_pipe_fd);
-  close(session.notif_pipe_fd);
-  unlink(session.req_pipe_path);
-  unlink(session.notif_pipe_path);
+  close(s->req_pipe_fd);
+  s->req_pipe_fd = -1;
+  unlink(s->req_pipe_path);
+  unlink(s->notif_pipe_path);
+  pthread_mutex_unlock(&s->req_lock);
+  return result;
+}
 
-  session.id = -1;
-  return 0;
+// Interrupts a receive in progress, waits for it to return and releases
+// what the session holds
+static void session_close(struct Session *s) {
+  atomic_store(&s->closing, 1);
+  if (s->wake_fds[1] != -1) {
+    char byte = 0;
+    while (write(s->wake_fds[1], &byte, 1) == -1 && errno == EINTR);
+  }
+
+  pthread_mutex_lock(&s->recv_lock);
+  if (s->notif_pipe_fd != -1) close(s->notif_pipe_fd);
+  s->notif_pipe_fd = -1;
+  for (int i = 0; i < 2; i++) {
+    if (s->wake_fds[i] != -1) close(s->wake_fds[i]);
+    s->wake_fds[i] = -1;
+  }
+  free(s->board_data);
+  s->board_data = NULL;
+  if (s->ring) munmap(s->ring, s->ring_size);
+  s->ring = NULL;
+  s->id = -1;
+  pthread_mutex_unlock(&s->recv_lock);
 }
 
-void pacman_play(char command) {
-  if (session.id == -1) return;
+void pacman_session_free(pacman_session_t *s) {
+  if (!s) return;
+  pacman_session_disconnect(s);
+  session_close(s);
+  pthread_mutex_destroy(&s->req_lock);
+  pthread_mutex_destroy(&s->recv_lock);
+  free(s);
+}
 
+void pacman_session_play(pacman_session_t *s, char command) {
   msg_play_t msg; 
   msg.op_code = OP_CODE_PLAY;
   msg.command = command;
 
-  if (write(session.req_pipe_fd, &msg, sizeof(msg)) == -1) {
+  pthread_mutex_lock(&s->req_lock);
+  if (s->req_pipe_fd != -1 && write(s->req_pipe_fd, &msg, sizeof(msg)) == -1) {
       perror("Failed to send play command");
   }
+  pthread_mutex_unlock(&s->req_lock);
+}
+
+int pacman_session_notif_fd(pacman_session_t *s) {
+  return s->notif_pipe_fd;
+}
+
+int pacman_connect(char const *req_pipe_path, char const *notif_pipe_path, char const *server_pipe_path) {
+  return session_connect(&session, OP_CODE_CONNECT, req_pipe_path, notif_pipe_path, server_pipe_path);
+}
+
+int pacman_disconnect() {
+  if (session.id == -1) return 0;
+  pacman_session_disconnect(&session);
+  session_close(&session);
+  return 0;
+}
+
+void pacman_play(char command) {
+  if (session.id == -1) return;
+  pacman_session_play(&session, command);
 }
 
 Board receive_board_update(void) {
-  Board b = {0};
-  if (session.id == -1) {
-      b.game_over = 1;
-      return b;
+  return pacman_session_receive(&session);
+}
+
+// Waits until the notification pipe is readable. Returns -1 if the session is closing.
+static int wait_notif(struct Session *s) {
+  struct pollfd fds[2] = {
+    { .fd = s->notif_pipe_fd, .events = POLLIN },
+    { .fd = s->wake_fds[0], .events = POLLIN },
+  };
+  while (poll(fds, 2, -1) == -1) {
+    if (errno != EINTR) return -1;
   }
+  return fds[1].revents ? -1 : 0;
+}
 
-  msg_board_header_t head;
-  ssize_t bytes_read = read(session.notif_pipe_fd, &head, sizeof(head));
+// Reads exactly size bytes of the notification pipe. Returns 0 on success, -1
+// if the pipe closed or failed or the session is closing.
+static int read_full(struct Session *s, void *buf, size_t size) {
+  size_t total_read = 0;
+  while (total_read < size) {
+    ssize_t r = read(s->notif_pipe_fd, (char*)buf + total_read, size - total_read);
+    if (r == -1 && errno == EAGAIN) {
+      if (wait_notif(s) != 0) return -1;
+      continue;
+    }
+    if (r == -1 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    total_read += r;
+  }
+  return 0;
+}
 
-  if (bytes_read <= 0) {
-      b.game_over = 1;
-      return b;
+// Reads the next size bytes of the frame being decoded, from the ring slot
+// or from the pipe
+static int session_read(struct Session *s, void *buf, size_t size) {
+  if (!s->src) return read_full(s, buf, size);
+  if (size > s->src_left) return -1;
+  memcpy(buf, s->src, size);
+  s->src += size;
+  s->src_left -= size;
+  return 0;
+}
+
+// Reads a keyframe into the session board. Returns -1 if the pipe failed.
+static int read_keyframe(struct Session *s, msg_board_header_t *head) {
+  if (session_read(s, (char*)head + sizeof(int), sizeof(*head) - sizeof(int)) != 0) return -1;
+  if (head->game_over) return 0;
+
+  int data_size = head->width * head->height;
+  if (head->width != s->width || head->height != s->height) {
+    char *data = realloc(s->board_data, data_size);
+    if (!data && data_size > 0) return -1;
+    s->board_data = data;
+    s->width = head->width;
+    s->height = head->height;
   }
 
-  if (head.op_code != OP_CODE_BOARD) {
+  if (session_read(s, s->board_data, data_size) != 0) return -1;
+  s->seq = head->seq;
+  return 0;
+}
+
+// Reads a delta and applies it if it follows the session board.
+// Returns 1 if it was applied, 0 if it was skipped and -1 if the pipe failed.
+static int read_delta(struct Session *s, msg_board_delta_t *head) {
+  if (session_read(s, (char*)head + sizeof(int), sizeof(*head) - sizeof(int)) != 0) return -1;
+  if (head->game_over) return 1;
+
+  // a frame was lost, the board stays as is until the next keyframe
+  int apply = s->board_data && head->seq == s->seq + 1;
+  int size = s->width * s->height;
+
+  msg_board_cell_t cells[CELL_BATCH];
+  for (int done = 0; done < head->n_cells; ) {
+    int n = head->n_cells - done < CELL_BATCH ? head->n_cells - done : CELL_BATCH;
+    if (session_read(s, cells, n * sizeof(msg_board_cell_t)) != 0) return -1;
+    for (int i = 0; apply && i < n; i++) {
+      if (cells[i].index >= 0 && cells[i].index < size) {
+        s->board_data[cells[i].index] = cells[i].glyph;
+      }
+    }
+    done += n;
+  }
+
+  if (apply) s->seq = head->seq;
+  return apply;
+}
+
+// Reads the frame that starts with op_code into b.
+// Returns 1 if b holds a board, 0 if the frame was skipped and -1 on failure.
+static int read_frame(struct Session *s, int op_code, Board *b) {
+  if (op_code == OP_CODE_BOARD) {
+      msg_board_header_t head;
+      if (read_keyframe(s, &head) != 0) return -1;
+      b->tempo = head.tempo;
+      b->victory = head.victory;
+      b->game_over = head.game_over;
+      b->accumulated_points = head.accumulated_points;
+  }
+  else if (op_code == OP_CODE_BOARD_DELTA) {
+      msg_board_delta_t head;
+      int applied = read_delta(s, &head);
+      if (applied != 1) return applied;
+      b->tempo = head.tempo;
+      b->victory = head.victory;
+      b->game_over = head.game_over;
+      b->accumulated_points = head.accumulated_points;
+  }
+  else {
       // Ignore or handle other opcodes
       // If we received something else, maybe sync error?
+      return 1;
+  }
+
+  if (!b->game_over) {
+      b->width = s->width;
+      b->height = s->height;
+      b->data = s->board_data;
+  }
+  return 1;
+}
+
+// Decodes the next frame of the ring. Returns 0 if there is none and the
+// client may block on the pipe, 2 if the frame was skipped, otherwise like read_frame.
+static int read_ring_frame(struct Session *s, Board *b) {
+  shm_ring_t *ring = s->ring;
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+    // seq_cst pairs with the server publishing and then checking waiting
+    atomic_store(&ring->waiting, 1);
+    if (tail == atomic_load(&ring->head)) return 0;
+  }
+
+  shm_slot_t *slot = shm_ring_slot(ring, tail);
+  if (slot->size > ring->slot_size) return -1;
+  s->src = slot->data;
+  s->src_left = slot->size;
+
+  int op_code;
+  int result = session_read(s, &op_code, sizeof(op_code));
+  if (result == 0) result = read_frame(s, op_code, b);
+  s->src = NULL;
+
+  // hands the slot back to the server
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return result == 0 ? 2 : result;
+}
+
+shm_ring_t *pacman_shm_attach(const char *name, size_t *size) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd == -1) return NULL;
+  shm_unlink(name); // nobody else needs the name, nothing is left behind if we crash
+
+  struct stat st;
+  shm_ring_t *ring = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(shm_ring_t)) {
+    ring = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (ring == MAP_FAILED) return NULL;
+  if (ring->n_slots == 0 || shm_ring_size(ring->n_slots, ring->slot_size) > (size_t)st.st_size) {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+
+  *size = st.st_size;
+  return ring;
+}
+
+// Maps the ring the server announced, replacing the one it already emptied
+static int attach_ring(struct Session *s) {
+  msg_shm_attach_t msg;
+  if (read_full(s, (char*)&msg + sizeof(int), sizeof(msg) - sizeof(int)) != 0) return -1;
+  msg.name[MAX_SHM_NAME_LENGTH - 1] = '\0';
+
+  size_t size;
+  shm_ring_t *ring = pacman_shm_attach(msg.name, &size);
+  if (!ring) return -1;
+
+  if (s->ring) munmap(s->ring, s->ring_size);
+  s->ring = ring;
+  s->ring_size = size;
+  return 0;
+}
+
+static Board session_receive(struct Session *s) {
+  Board b = {0};
+  if (s->id == -1 || atomic_load(&s->closing)) {
+      b.game_over = 1;
       return b;
   }
 
-  b.width = head.width;
-  b.height = head.height;
-  b.tempo = head.tempo;
-  b.victory = head.victory;
-  b.game_over = head.game_over;
-  b.accumulated_points = head.accumulated_points;
+  while (true) {
+    int result = 0;
+    if (s->ring) {
+      result = read_ring_frame(s, &b);
+      if (result == 2) continue;
+    }
 
-  int data_size = b.width * b.height;
-  if (data_size > 0) {
-      b.data = malloc(data_size);
-      if (!b.data) {
+    if (result == 0) {
+      int op_code;
+      if (read_full(s, &op_code, sizeof(op_code)) != 0) {
           b.game_over = 1;
           return b;
       }
-      
-      int total_read = 0;
-      while (total_read < data_size) {
-        int r = read(session.notif_pipe_fd, b.data + total_read, data_size - total_read);
-        if (r <= 0) {
-            free(b.data);
-            b.data = NULL;
-            b.game_over = 1;
-            return b;
-        }
-        total_read += r;
+
+      if (op_code == OP_CODE_SHM_WAKE) continue;
+      if (op_code == OP_CODE_SHM_ATTACH) {
+        result = attach_ring(s) == 0 ? 0 : -1;
+        if (result == 0) continue;
+      }
+      else {
+        result = read_frame(s, op_code, &b);
+        if (result == 0) continue;
       }
+    }
+
+    if (result == -1) {
+        Board over = {0};
+        over.game_over = 1;
+        return over;
+    }
+    return b;
   }
+}
 
+Board pacman_session_receive(pacman_session_t *s) {
+  pthread_mutex_lock(&s->recv_lock);
+  Board b = session_receive(s);
+  pthread_mutex_unlock(&s->recv_lock);
   return b;
 }
-
-
@@ -12,11 +12,44 @@
 #include <unistd.h>
 #include <pthread.h>
 
-Board board;
+#define RENDER_INTERVAL_MS 16 // the screen is redrawn at most this often
+
+/*
+Frames go from the receiver thread to the renderer through two buffers.
+The receiver copies every frame into slots[back] and the renderer swaps it
+with slots[front] before drawing, so a frame that arrives while the renderer
+is busy replaces the one waiting and only the newest is ever drawn.
+*/
+typedef struct {
+    Board board;
+    size_t capacity; // bytes allocated for board.data
+} frame_slot_t;
+
+static frame_slot_t slots[2];
+static int front = 0; // drawn by the main thread, never touched by the receiver
+static int back = 1;
+static bool fresh = false; // slots[back] holds a frame not drawn yet
+static unsigned long dropped = 0; // frames replaced before being drawn
+
 bool stop_execution = false;
 int tempo;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Copies a received board into a slot, growing it only when the board does
+static void store_frame(frame_slot_t *slot, Board board) {
+    size_t size = (size_t)board.width * board.height;
+    if (size > slot->capacity) {
+        char *data = realloc(slot->board.data, size);
+        if (!data) return;
+        slot->board.data = data;
+        slot->capacity = size;
+    }
+    char *data = slot->board.data;
+    memcpy(data, board.data, size);
+    slot->board = board;
+    slot->board.data = data;
+}
+
 static void *receiver_thread(void *arg) {
     (void)arg;
 
@@ -33,16 +66,34 @@ static void *receiver_thread(void *arg) {
 
         pthread_mutex_lock(&mutex);
         tempo = board.tempo;
+        if (fresh) dropped++;
+        store_frame(&slots[back], board);
+        fresh = true;
         pthread_mutex_unlock(&mutex);
-
-        draw_board_client(board);
-        refresh_screen();
     }
 
     debug("Returning receiver thread...\n");
     return NULL;
 }
 
+// Draws the newest frame if there is one the screen does not show yet
+static void render_frame() {
+    pthread_mutex_lock(&mutex);
+    bool draw = fresh;
+    if (fresh) {
+        int t = front;
+        front = back;
+        back = t;
+        fresh = false;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (draw) {
+        draw_board_client(slots[front].board);
+        refresh_screen();
+    }
+}
+
 int main(int argc, char *argv[]) {
     if (argc != 3 && argc != 4) {
         fprintf(stderr,
@@ -84,11 +135,13 @@ int main(int argc, char *argv[]) {
     pthread_create(&receiver_thread_id, NULL, receiver_thread, NULL);
 
     terminal_init();
-    set_timeout(500);
-    draw_board_client(board);
+    set_timeout(RENDER_INTERVAL_MS);
     refresh_screen();
 
+    // only this thread uses ncurses: it draws between reading the inputs
+    int script_wait = 0; // ms until the next command of the file
     while (1) {
+        render_frame();
 
         pthread_mutex_lock(&mutex);
         if (stop_execution) {
@@ -99,12 +152,17 @@ int main(int argc, char *argv[]) {
 
         char command = 0;
         if (cmd_fp) {
+            if (script_wait > 0) {
+                sleep_ms(RENDER_INTERVAL_MS);
+                script_wait -= RENDER_INTERVAL_MS;
+                continue;
+            }
             int c = fgetc(cmd_fp);
             if (c == EOF) {
                 rewind(cmd_fp);
                 continue;
             }
-            sleep_ms(100); // 100ms
+            script_wait = 100; // 100ms
             command = (char)c;
         } else {
             int c = getch();
@@ -130,6 +188,9 @@ int main(int argc, char *argv[]) {
         fclose(cmd_fp);
 
     pthread_mutex_destroy(&mutex);
+    debug("Frames dropped by the renderer: %lu\n", dropped);
+    free(slots[0].board.data);
+    free(slots[1].board.data);
 
     terminal_cleanup();
 
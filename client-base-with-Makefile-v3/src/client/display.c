@@ -3,6 +3,7 @@
 #include "api.h"
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 
 
 int terminal_init() {
@@ -47,85 +48,99 @@ int terminal_init() {
 }
 
 
-void draw_board_client(Board board) {
-    // Clear the screen before redrawing
-    clear();
-
-    // Draw the border/title
-    attron(COLOR_PAIR(5));
-    mvprintw(0, 0, "=== PACMAN GAME ===");
-    if (board.game_over) {
-        mvprintw(1, 0, " GAME OVER ");
-    } else if (board.victory) {
-        mvprintw(1, 0, " VICTORY ");
-    } else {
-        mvprintw(1, 0, " Use W/A/S/D to move | Q to quit");
+// Last frame draw_board_client put on the screen, only cells that differ
+// from it are drawn again
+static char *drawn = NULL;
+static char *run = NULL; // glyphs of a run of cells with the same attributes
+static int drawn_width = 0, drawn_height = 0;
+static int drawn_status = -1;
+
+// Attributes and glyph of a cell received from the server
+static int cell_style(char ch, char *glyph) {
+    *glyph = ch;
+    switch (ch) {
+        case '#': return COLOR_PAIR(3);                     // Wall
+        case 'C': return COLOR_PAIR(1) | A_BOLD;            // Pacman
+        case 'M': return COLOR_PAIR(2) | A_BOLD;            // Monster/Ghost
+        case 'G': *glyph = 'M';                             // Charged Monster/Ghost
+                  return COLOR_PAIR(2) | A_BOLD | A_DIM;
+        case '.': return COLOR_PAIR(4);                     // Dot
+        case '@': return COLOR_PAIR(6);                     // Portal
+        default:  return A_NORMAL;                          // Empty space
     }
+}
 
+void draw_board_client(Board board) {
     // Starting row for the game board (leave space for UI)
     int start_row = 3;
 
-    // Draw the board
-    for (int y = 0; y < board.height; y++) {
-        for (int x = 0; x < board.width; x++) {
-            char ch = board.data[y * board.width + x];
-
-            // Move cursor to position
-            move(start_row + y, x);
-
-            // Draw with appropriate color
-            switch (ch) {
-                case '#': // Wall
-                    attron(COLOR_PAIR(3));
-                    addch('#');
-                    attroff(COLOR_PAIR(3));
-                    break;
-
-                case 'C': // Pacman
-                    attron(COLOR_PAIR(1) | A_BOLD);
-                    addch('C');
-                    attroff(COLOR_PAIR(1) | A_BOLD);
-                    break;
-
-                case 'M': // Monster/Ghost
-                    attron(COLOR_PAIR(2) | A_BOLD);
-                    addch('M');
-                    attroff(COLOR_PAIR(2) | A_BOLD);  
-                    break;
-
-                case 'G': // Charged Monster/Ghost
-                    attron((COLOR_PAIR(2) | A_BOLD) | A_DIM);
-                    addch('M');
-                    attroff((COLOR_PAIR(2) | A_BOLD) | A_DIM);  
-                    break;
-
-                case '.': // Dot
-                    attron(COLOR_PAIR(4));
-                    addch('.');
-                    attroff(COLOR_PAIR(4));
-                    break;
+    // Clear and redraw everything only when there is nothing to compare with
+    int full = !drawn || board.width != drawn_width || board.height != drawn_height;
+    if (full) {
+        size_t size = (size_t)board.width * board.height;
+        char *grid = realloc(drawn, size ? size : 1);
+        char *glyphs = realloc(run, board.width ? board.width : 1);
+        if (grid) drawn = grid;
+        if (glyphs) run = glyphs;
+        if (!grid || !glyphs) return;
+        drawn_width = board.width;
+        drawn_height = board.height;
+        drawn_status = -1;
+
+        clear();
+        attron(COLOR_PAIR(5));
+        mvprintw(0, 0, "=== PACMAN GAME ===");
+        attroff(COLOR_PAIR(5));
+    }
 
-                case '@': // Portal
-                    attron(COLOR_PAIR(6));
-                    addch('@');
-                    attroff(COLOR_PAIR(6));
-                    break;
+    // Draw the border/title
+    int status = board.game_over ? DRAW_GAME_OVER : board.victory ? DRAW_WIN : DRAW_MENU;
+    if (status != drawn_status) {
+        attron(COLOR_PAIR(5));
+        move(1, 0);
+        clrtoeol();
+        if (board.game_over) {
+            mvprintw(1, 0, " GAME OVER ");
+        } else if (board.victory) {
+            mvprintw(1, 0, " VICTORY ");
+        } else {
+            mvprintw(1, 0, " Use W/A/S/D to move | Q to quit");
+        }
+        attroff(COLOR_PAIR(5));
+        drawn_status = status;
+    }
 
-                case ' ': // Empty space
-                    addch(' ');
-                    break;
+    // Draw the cells that changed, one addnstr per run of cells with the same attributes
+    for (int y = 0; board.data && y < board.height; y++) {
+        char *row = board.data + y * board.width;
+        char *drawn_row = drawn + y * board.width;
+        int x = 0;
+        while (x < board.width) {
+            if (!full && row[x] == drawn_row[x]) {
+                x++;
+                continue;
+            }
 
-                default:
-                    addch(ch);
-                    break;
+            int start = x, n = 0;
+            int attr = cell_style(row[x], &run[n++]);
+            for (x++; x < board.width && (full || row[x] != drawn_row[x]); x++) {
+                char glyph;
+                if (cell_style(row[x], &glyph) != attr) break;
+                run[n++] = glyph;
             }
+
+            attron(attr);
+            mvaddnstr(start_row + y, start, run, n);
+            attroff(attr);
         }
+        memcpy(drawn_row, row, board.width);
     }
 
     // Draw score/status at the bottom
     attron(COLOR_PAIR(5));
     mvprintw(start_row + board.height + 1, 0, "Points: %d",
              board.accumulated_points);
+    clrtoeol();
     attroff(COLOR_PAIR(5));
 }
 
@@ -0,0 +1,552 @@
+#include "api.h"
+#include "protocol.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+
+/*
+Load generator: plays many sessions against one server from a single thread.
+Every session connects through the register FIFO, sends OP_CODE_PLAY commands
+at a fixed rate (random moves or a commands file played in a loop) and reads
+its notification pipe without decoding the boards.
+At the end prints connect latency, frame inter-arrival times and throughput
+as key=value lines.
+With -m the sessions ask for frames through shared memory, see protocol.h.
+With -w, once the sessions are connecting, that many spectators watch game -g
+(the oldest one by default) and count the frames they get.
+Usage: loadgen [-n sessions] [-c connects_per_s] [-r plays_per_s] [-d seconds]
+               [-f commands_file] [-p prefix] [-m] [-w spectators] [-g game_id] <register_pipe>
+*/
+
+#define BUF_SIZE 65536
+#define MAX_EVENTS 256
+#define HIST_SUB 16 // sub-buckets per power of two, values are within 1/16 of the truth
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef enum {
+  LG_IDLE,       // not connected yet
+  LG_OPENED,     // pipes ready, the register FIFO was full
+  LG_CONNECTING, // connect request sent, waiting for the first frame
+  LG_PLAYING,
+  LG_DONE,       // game over, server gone or failed to connect
+} lg_state_t;
+
+typedef struct {
+  int id;
+  int spectator; // -w: watches instead of playing, has no request pipe
+  lg_state_t state;
+  int req_fd;
+  int notif_fd;
+  char req_pipe_path[MAX_PIPE_PATH_LENGTH];
+  char notif_pipe_path[MAX_PIPE_PATH_LENGTH];
+
+  // notification stream, frames are framed but not decoded
+  char buf[BUF_SIZE];
+  size_t len;
+  size_t skip; // payload bytes of the current frame still to be read
+
+  uint64_t connect_ns;   // when the connect request was sent
+  uint64_t last_frame_ns;
+  uint64_t last_iat_ns;  // previous inter-arrival time, for the jitter
+  uint64_t next_play_ns;
+  long cmd_pos;          // position in the commands script
+  uint64_t rng;
+  shm_ring_t *ring; // -m: attached by the server with the first frame
+  size_t ring_size;
+} lg_session_t;
+
+typedef struct {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t n;
+  uint64_t max;
+} histogram_t;
+
+static int N_SESSIONS = 100;
+static int CONNECTS_PER_S = 1000;
+static int PLAYS_PER_S = 5;
+static int DURATION_S = 10;
+static char *SCRIPT = NULL; // commands file contents, NULL plays random moves
+static long SCRIPT_LEN = 0;
+static char PREFIX[16] = "lg";
+static int USE_SHM = 0;
+static int N_SPECTATORS = 0;
+static int SPECTATE_GAME = 0; // 0 is the oldest game
+
+static histogram_t connect_hist; // microseconds from connect request to first frame
+static histogram_t iat_hist;     // microseconds between two frames of a session
+static uint64_t jitter_sum_us;   // sum of |iat - previous iat|
+static uint64_t jitter_n;
+static uint64_t frames, keyframes, bytes, plays, play_errors;
+static uint64_t ring_frames, wakes;
+static int connected, finished, failed, unserved;
+static uint64_t spectator_frames;
+static int spectating, spectators_failed;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+  if (v < HIST_SUB) return v;
+  int shift = 63 - __builtin_clzll(v) - 4;
+  return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_value(int index) {
+  if (index < HIST_SUB) return index;
+  int shift = index / HIST_SUB - 1;
+  return (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+}
+
+static void hist_add(histogram_t *h, uint64_t v) {
+  h->counts[hist_index(v)]++;
+  h->n++;
+  if (v > h->max) h->max = v;
+}
+
+static uint64_t hist_percentile(histogram_t *h, double p) {
+  if (h->n == 0) return 0;
+  uint64_t rank = (uint64_t)(p * (h->n - 1)) + 1, seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen >= rank) return hist_value(i);
+  }
+  return h->max;
+}
+
+static uint32_t session_random(lg_session_t *s) {
+  s->rng ^= s->rng << 13;
+  s->rng ^= s->rng >> 7;
+  s->rng ^= s->rng << 17;
+  return (uint32_t) s->rng;
+}
+
+// Closes the pipes of a session and counts how it ended
+static void session_end(lg_session_t *s, int epoll_fd, int disconnect) {
+  if (s->state == LG_DONE || s->state == LG_IDLE) return;
+  if (s->state == LG_OPENED) s->state = LG_CONNECTING; // never got through the register FIFO
+
+  if (s->spectator) {
+    if (s->state != LG_PLAYING) spectators_failed++;
+  }
+  else if (disconnect && s->state == LG_PLAYING) {
+    msg_disconnect_t msg = {OP_CODE_DISCONNECT};
+    if (write(s->req_fd, &msg, sizeof(msg)) == -1) play_errors++;
+  }
+  if (!s->spectator && s->state != LG_PLAYING) {
+    if (disconnect) unserved++; // still queued for a slot
+    else failed++;
+  }
+  else if (!s->spectator && !disconnect) finished++;
+
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->notif_fd, NULL);
+  close(s->notif_fd);
+  if (s->req_fd != -1) close(s->req_fd);
+  unlink(s->req_pipe_path);
+  unlink(s->notif_pipe_path);
+  if (s->ring) munmap(s->ring, s->ring_size);
+  s->state = LG_DONE;
+}
+
+/*
+Creates the session pipes without ever blocking: the notification pipe is
+opened for reading with O_NONBLOCK and the request pipe with O_RDWR, so the
+server's opens of both ends succeed as soon as it gets to them.
+*/
+static int session_open(lg_session_t *s, int epoll_fd) {
+  snprintf(s->req_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/%s%d_%d_request", PREFIX, getpid(), s->id);
+  snprintf(s->notif_pipe_path, MAX_PIPE_PATH_LENGTH, "/tmp/%s%d_%d_notif", PREFIX, getpid(), s->id);
+
+  if ((mkfifo(s->req_pipe_path, 0666) == -1 && errno != EEXIST) ||
+      (mkfifo(s->notif_pipe_path, 0666) == -1 && errno != EEXIST)) {
+    perror("Failed to create session pipes");
+    unlink(s->req_pipe_path);
+    return -1;
+  }
+
+  s->notif_fd = open(s->notif_pipe_path, O_RDONLY | O_NONBLOCK);
+  s->req_fd = s->spectator ? -1 : open(s->req_pipe_path, O_RDWR | O_NONBLOCK);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+  if (s->notif_fd == -1 || (s->req_fd == -1 && !s->spectator) || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->notif_fd, &ev) == -1) {
+    perror("Failed to open session pipes");
+    if (s->notif_fd != -1) close(s->notif_fd);
+    if (s->req_fd != -1) close(s->req_fd);
+    unlink(s->req_pipe_path);
+    unlink(s->notif_pipe_path);
+    return -1;
+  }
+  s->state = LG_OPENED;
+  return 0;
+}
+
+// Returns 1 if the register FIFO is full and the request must be sent later
+static int session_connect(lg_session_t *s, int server_fd, int epoll_fd) {
+  if (s->state == LG_IDLE && session_open(s, epoll_fd) == -1) return -1;
+
+  msg_connect_t msg = {0};
+  msg.op_code = USE_SHM ? OP_CODE_CONNECT_SHM : OP_CODE_CONNECT;
+  strncpy(msg.req_pipe_path, s->req_pipe_path, MAX_PIPE_PATH_LENGTH);
+  strncpy(msg.notif_pipe_path, s->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+
+  // the notification pipe is already open for reading, as the server expects
+  msg_spectate_t spectate = {0};
+  spectate.op_code = OP_CODE_SPECTATE;
+  strncpy(spectate.notif_pipe_path, s->notif_pipe_path, MAX_PIPE_PATH_LENGTH);
+  spectate.game_id = SPECTATE_GAME;
+
+  const void *req = s->spectator ? (const void*) &spectate : (const void*) &msg;
+  ssize_t size = s->spectator ? (ssize_t) sizeof(spectate) : (ssize_t) sizeof(msg);
+
+  // the server stops reading the FIFO once enough connects wait for a slot
+  if (write(server_fd, req, size) != size) {
+    if (errno == EAGAIN) return 1;
+    perror("Failed to send connect request");
+    s->state = LG_CONNECTING;
+    session_end(s, epoll_fd, 0);
+    return -1;
+  }
+  s->connect_ns = now_ns();
+  s->state = LG_CONNECTING;
+  return 0;
+}
+
+static void frame_received(lg_session_t *s, uint64_t now) {
+  if (s->spectator) {
+    spectator_frames++;
+    if (s->state == LG_CONNECTING) spectating++;
+    s->state = LG_PLAYING;
+    return;
+  }
+
+  frames++;
+  if (s->state == LG_CONNECTING) {
+    hist_add(&connect_hist, (now - s->connect_ns) / 1000);
+    s->state = LG_PLAYING;
+    s->next_play_ns = now + session_random(s) % (1000000000ULL / PLAYS_PER_S); // spread the plays
+    connected++;
+  }
+  else {
+    uint64_t iat = now - s->last_frame_ns;
+    hist_add(&iat_hist, iat / 1000);
+    if (s->last_iat_ns) {
+      jitter_sum_us += (iat > s->last_iat_ns ? iat - s->last_iat_ns : s->last_iat_ns - iat) / 1000;
+      jitter_n++;
+    }
+    s->last_iat_ns = iat;
+  }
+  s->last_frame_ns = now;
+}
+
+// Maps the ring named in an attach message, the old one is already empty
+static int attach_ring(lg_session_t *s, msg_shm_attach_t *msg) {
+  msg->name[MAX_SHM_NAME_LENGTH - 1] = '\0';
+  size_t size;
+  shm_ring_t *ring = pacman_shm_attach(msg->name, &size);
+  if (!ring) return -1;
+
+  if (s->ring) munmap(s->ring, s->ring_size);
+  s->ring = ring;
+  s->ring_size = size;
+  return 0;
+}
+
+// Consumes every frame published in the ring, then tells the server we wait on
+// the pipe. Returns -1 if a slot claims more bytes than it holds.
+static int drain_ring(lg_session_t *s, uint64_t now) {
+  if (!s->ring) return 0;
+  shm_ring_t *ring = s->ring;
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  while (1) {
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+      atomic_store(&ring->waiting, 1);
+      if (tail == atomic_load(&ring->head)) return 0;
+      continue;
+    }
+    for (; tail != head; tail++) {
+      shm_slot_t *slot = shm_ring_slot(ring, tail);
+      if (slot->size > ring->slot_size || slot->size < sizeof(int)) return -1;
+      int op_code;
+      memcpy(&op_code, slot->data, sizeof(op_code));
+      if (op_code == OP_CODE_BOARD) keyframes++;
+      bytes += slot->size;
+      ring_frames++;
+      frame_received(s, now);
+    }
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+  }
+}
+
+// Splits the buffered notification stream into frames. Returns 1 on game over.
+static int parse_frames(lg_session_t *s, uint64_t now) {
+  size_t pos = 0;
+  while (1) {
+    if (s->skip) {
+      size_t n = s->len - pos < s->skip ? s->len - pos : s->skip;
+      pos += n;
+      s->skip -= n;
+      if (s->skip) break;
+    }
+
+    if (s->len - pos < sizeof(int)) break;
+    int op_code;
+    memcpy(&op_code, s->buf + pos, sizeof(op_code));
+
+    int game_over;
+    if (op_code == OP_CODE_SHM_WAKE) {
+      pos += sizeof(msg_shm_wake_t);
+      wakes++;
+      if (drain_ring(s, now) == -1) return 1;
+      continue;
+    }
+    else if (op_code == OP_CODE_SHM_ATTACH) {
+      msg_shm_attach_t msg;
+      if (s->len - pos < sizeof(msg)) break;
+      memcpy(&msg, s->buf + pos, sizeof(msg));
+      pos += sizeof(msg);
+      if (attach_ring(s, &msg) == -1 || drain_ring(s, now) == -1) return 1;
+      continue;
+    }
+    else if (op_code == OP_CODE_BOARD) {
+      if (drain_ring(s, now) == -1) return 1; // frames published before the game over
+      msg_board_header_t head;
+      if (s->len - pos < sizeof(head)) break;
+      memcpy(&head, s->buf + pos, sizeof(head));
+      pos += sizeof(head);
+      game_over = head.game_over;
+      if (!game_over) s->skip = (size_t)head.width * head.height;
+      keyframes++;
+    }
+    else if (op_code == OP_CODE_BOARD_DELTA) {
+      msg_board_delta_t head;
+      if (s->len - pos < sizeof(head)) break;
+      memcpy(&head, s->buf + pos, sizeof(head));
+      pos += sizeof(head);
+      game_over = head.game_over;
+      if (!game_over) s->skip = (size_t)head.n_cells * sizeof(msg_board_cell_t);
+    }
+    else {
+      return 1; // out of sync, nothing after this can be trusted
+    }
+
+    frame_received(s, now);
+    if (game_over) return 1;
+  }
+
+  memmove(s->buf, s->buf + pos, s->len - pos);
+  s->len -= pos;
+  return 0;
+}
+
+static void session_readable(lg_session_t *s, int epoll_fd, uint64_t now) {
+  while (1) {
+    ssize_t n = read(s->notif_fd, s->buf + s->len, BUF_SIZE - s->len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EAGAIN) return;
+    if (n <= 0) {
+      session_end(s, epoll_fd, 0); // server closed the session
+      return;
+    }
+    bytes += n;
+    s->len += n;
+    if (parse_frames(s, now)) {
+      session_end(s, epoll_fd, 0);
+      return;
+    }
+  }
+}
+
+static void session_play(lg_session_t *s, uint64_t now) {
+  char command;
+  if (SCRIPT) {
+    do {
+      command = SCRIPT[s->cmd_pos];
+      s->cmd_pos = (s->cmd_pos + 1) % SCRIPT_LEN;
+    } while (command == ' ' || command == '\n' || command == '\t' || command == '\r');
+  }
+  else {
+    command = "WASD"[session_random(s) % 4];
+  }
+
+  msg_play_t msg = {OP_CODE_PLAY, command};
+  if (write(s->req_fd, &msg, sizeof(msg)) == sizeof(msg)) plays++;
+  else play_errors++; // request pipe full, the server is behind
+
+  s->next_play_ns += 1000000000ULL / PLAYS_PER_S;
+  if (s->next_play_ns < now) s->next_play_ns = now; // do not burst to catch up
+}
+
+static int load_script(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (!f) return -1;
+  SCRIPT = malloc(BUF_SIZE);
+  SCRIPT_LEN = 0;
+  int c;
+  while ((c = fgetc(f)) != EOF && SCRIPT_LEN < BUF_SIZE) {
+    if (c == ' ' || c == '\n' || c == '\t' || c == '\r') continue;
+    if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+    SCRIPT[SCRIPT_LEN++] = c;
+  }
+  fclose(f);
+  if (SCRIPT_LEN == 0) {
+    free(SCRIPT);
+    SCRIPT = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void report(double elapsed_s) {
+  printf("sessions=%d\n", N_SESSIONS);
+  printf("connected=%d\n", connected);
+  printf("failed=%d\n", failed);
+  printf("finished=%d\n", finished);
+  printf("unserved=%d\n", unserved);
+  printf("elapsed_s=%.3f\n", elapsed_s);
+  printf("connect_p50_us=%lu\n", hist_percentile(&connect_hist, 0.50));
+  printf("connect_p99_us=%lu\n", hist_percentile(&connect_hist, 0.99));
+  printf("connect_max_us=%lu\n", connect_hist.max);
+  printf("frames=%lu\n", frames);
+  printf("keyframes=%lu\n", keyframes);
+  printf("ring_frames=%lu\n", ring_frames);
+  printf("wakes=%lu\n", wakes);
+  printf("frames_per_s=%.0f\n", frames / elapsed_s);
+  printf("bytes_per_s=%.0f\n", bytes / elapsed_s);
+  printf("iat_p50_us=%lu\n", hist_percentile(&iat_hist, 0.50));
+  printf("iat_p90_us=%lu\n", hist_percentile(&iat_hist, 0.90));
+  printf("iat_p99_us=%lu\n", hist_percentile(&iat_hist, 0.99));
+  printf("iat_max_us=%lu\n", iat_hist.max);
+  printf("jitter_us=%.1f\n", jitter_n ? (double) jitter_sum_us / jitter_n : 0.0);
+  printf("plays=%lu\n", plays);
+  printf("plays_per_s=%.0f\n", plays / elapsed_s);
+  printf("play_errors=%lu\n", play_errors);
+  printf("spectators=%d\n", N_SPECTATORS);
+  printf("spectating=%d\n", spectating);
+  printf("spectators_failed=%d\n", spectators_failed);
+  printf("spectator_frames=%lu\n", spectator_frames);
+  printf("spectator_frames_per_s=%.0f\n", spectator_frames / elapsed_s);
+}
+
+int main(int argc, char** argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:r:d:f:p:mw:g:")) != -1) {
+    switch (opt) {
+      case 'n':
+        N_SESSIONS = atoi(optarg);
+        break;
+      case 'c':
+        CONNECTS_PER_S = atoi(optarg);
+        break;
+      case 'r':
+        PLAYS_PER_S = atoi(optarg);
+        break;
+      case 'd':
+        DURATION_S = atoi(optarg);
+        break;
+      case 'f':
+        if (load_script(optarg) == -1) {
+          fprintf(stderr, "Failed to read commands from %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'm':
+        USE_SHM = 1;
+        break;
+      case 'w':
+        N_SPECTATORS = atoi(optarg);
+        break;
+      case 'g':
+        SPECTATE_GAME = atoi(optarg);
+        break;
+      case 'p':
+        snprintf(PREFIX, sizeof(PREFIX), "%s", optarg);
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind != argc - 1 || N_SESSIONS <= 0 || CONNECTS_PER_S <= 0 || PLAYS_PER_S <= 0 || DURATION_S <= 0 || N_SPECTATORS < 0) goto usage;
+  const char *register_pipe = argv[optind];
+
+  signal(SIGPIPE, SIG_IGN); // a server that goes away shows up as EPIPE
+
+  // two pipes per session, one per spectator
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+
+  // spectators come last, so the games they watch have been asked for first
+  int n_clients = N_SESSIONS + N_SPECTATORS;
+  lg_session_t *sessions = calloc(n_clients, sizeof(lg_session_t));
+  int epoll_fd = epoll_create1(0);
+  int server_fd = open(register_pipe, O_WRONLY | O_NONBLOCK);
+  if (!sessions || epoll_fd == -1 || server_fd == -1) {
+    perror("Failed to start");
+    return 1;
+  }
+
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t) DURATION_S * 1000000000;
+  uint64_t connect_interval = 1000000000ULL / CONNECTS_PER_S;
+  int next_connect = 0;
+  for (int i = 0; i < n_clients; i++) {
+    sessions[i].id = i;
+    sessions[i].spectator = i >= N_SESSIONS;
+    sessions[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t now;
+  while ((now = now_ns()) < end) {
+    // ramp up at CONNECTS_PER_S
+    while (next_connect < n_clients && start + next_connect * connect_interval <= now) {
+      int r = session_connect(&sessions[next_connect], server_fd, epoll_fd);
+      if (r == 1) break;
+      if (r == -1 && sessions[next_connect].state == LG_IDLE) failed++;
+      next_connect++;
+    }
+
+    int active = 0;
+    for (int i = 0; i < next_connect; i++) {
+      lg_session_t *s = &sessions[i];
+      if (s->state == LG_PLAYING && !s->spectator && s->next_play_ns <= now) session_play(s, now);
+      active += s->state != LG_DONE;
+    }
+    if (!active && next_connect == n_clients) break; // every game is over
+
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 1); // plays are scheduled with 1ms granularity
+    now = now_ns();
+    for (int i = 0; i < n; i++) session_readable(events[i].data.ptr, epoll_fd, now);
+  }
+
+  double elapsed_s = (now_ns() - start) / 1e9;
+  for (int i = 0; i < next_connect; i++) session_end(&sessions[i], epoll_fd, 1);
+  close(server_fd);
+  close(epoll_fd);
+
+  report(elapsed_s);
+  free(sessions);
+  free(SCRIPT);
+  return 0;
+
+usage:
+  fprintf(stderr,
+      "Usage: %s [-n sessions] [-c connects_per_s] [-r plays_per_s] [-d seconds] [-f commands_file] [-p prefix] [-m] [-w spectators] [-g game_id] <register_pipe>\n",
+      argv[0]);
+  return 1;
+}